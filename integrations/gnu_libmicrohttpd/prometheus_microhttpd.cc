@@ -12,9 +12,15 @@
 
 #define TEXT_FORMAT_CONTENT_TYPE "text/plain; version=0.0.4"
 
-std::string collect_as_text_format_to_string() {
-  auto collection = prometheus::impl::global_registry.collect();
-  return prometheus::render(collection, prometheus::fmt_text);
+// Returns the metrics in the text format. Metrics are written straight
+// to a per-thread buffer, which keeps its capacity from one scrape to
+// the next, and is valid until the next call on the same thread.
+std::string const& collect_as_text_format_to_string() {
+  thread_local std::string buffer;
+  buffer.clear();
+  prometheus::TextSink sink(&buffer);
+  prometheus::impl::global_registry.collect(&sink);
+  return buffer;
 }
 
 MHD_Response* handle_metrics(struct MHD_Connection* connection) {
@@ -28,7 +34,8 @@ MHD_Response* handle_metrics(struct MHD_Connection* connection) {
   /*   accept_header = "text/plain"; */
   /* } */
   /* printf("Accepting: %s\n", accept_header); */
-  std::string s = collect_as_text_format_to_string();
+  // The response copies the buffer (MHD_YES below).
+  std::string const& s = collect_as_text_format_to_string();
   MHD_Response* response = MHD_create_response_from_data(s.length(),
                                                          (void*)s.c_str(),
                                                          MHD_NO,
@@ -54,7 +61,7 @@ void record_stats_before_access_handler(struct MHD_Connection* connection,
   const union MHD_ConnectionInfo* connection_info;
 
   connection_info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_PROTOCOL);
-  const std::string transport = (connection_info != NULL) ? "https" : "http";
+  const char* transport = (connection_info != NULL) ? "https" : "http";
 
   if (strcmp("GET", method) && strcmp("HEAD", method) &&
       strcmp("POST", method) && strcmp("PUT", method) &&
@@ -64,7 +71,7 @@ void record_stats_before_access_handler(struct MHD_Connection* connection,
     method = "<invalid method>";
   }
 
-  requests_total.labels({transport, std::string(method)}).inc();
+  requests_total.labels({transport, method}).inc();
 }
 
 Counter<1> responses_total("libmicrohttpd_http_responses_by_status_total",
@@ -73,7 +80,7 @@ Counter<1> responses_total("libmicrohttpd_http_responses_by_status_total",
 
 void record_stats_before_queue_response(int http_status,
                                         struct MHD_Response* response) {
-  responses_total.labels({std::to_string(http_status)}).inc();
+  responses_total.labels({http_status}).inc();
 }
 
 void install_process_exports() {
@@ -1,12 +1,19 @@
+#include "bucket_search.hh"
 #include "client.hh"
+#include "double_format.hh"
 #include "output_formatter.hh"
 #include "utils.hh"
+#include "prometheus/proto/metrics.pb.h"
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
 #include <functional>
 #include <thread>
 #include <list>
 #include <random>
+#include <vector>
 
 namespace {
 
@@ -52,6 +59,54 @@ namespace {
     EXPECT_EQ(111000000, counter0.value());
   }
 
+  // Same as above, with a sharded counter.
+  Counter<0, Sharded> sharded_counter0("sharded_counter0", "");
+  void incShardedCounter1000000(int threadid, int threadcount) {
+    for (int i = 0; i < 1000000; ++i) {
+      sharded_counter0.inc();
+    }
+  }
+  TEST_F(BenchmarkTest, IncShardedCounter) {
+    run(incShardedCounter1000000, "incShardedCounter1000000", 1);
+    EXPECT_EQ(1000000, sharded_counter0.value());
+    run(incShardedCounter1000000, "incShardedCounter1000000", 10);
+    EXPECT_EQ(11000000, sharded_counter0.value());
+    run(incShardedCounter1000000, "incShardedCounter1000000", 100);
+    EXPECT_EQ(111000000, sharded_counter0.value());
+  }
+
+  // Same as above, with a batched counter.
+  Counter<0, Batched> batched_counter0("batched_counter0", "");
+  void incBatchedCounter1000000(int threadid, int threadcount) {
+    for (int i = 0; i < 1000000; ++i) {
+      batched_counter0.inc();
+    }
+  }
+  TEST_F(BenchmarkTest, IncBatchedCounter) {
+    run(incBatchedCounter1000000, "incBatchedCounter1000000", 1);
+    EXPECT_EQ(1000000, batched_counter0.value());
+    run(incBatchedCounter1000000, "incBatchedCounter1000000", 10);
+    EXPECT_EQ(11000000, batched_counter0.value());
+    run(incBatchedCounter1000000, "incBatchedCounter1000000", 100);
+    EXPECT_EQ(111000000, batched_counter0.value());
+  }
+
+  // Same as above, with a counter stored as an integer.
+  Counter<0, uint64_t> integer_counter0("integer_counter0", "");
+  void incIntegerCounter1000000(int threadid, int threadcount) {
+    for (int i = 0; i < 1000000; ++i) {
+      integer_counter0.inc();
+    }
+  }
+  TEST_F(BenchmarkTest, IncIntegerCounter) {
+    run(incIntegerCounter1000000, "incIntegerCounter1000000", 1);
+    EXPECT_EQ(1000000, integer_counter0.value());
+    run(incIntegerCounter1000000, "incIntegerCounter1000000", 10);
+    EXPECT_EQ(11000000, integer_counter0.value());
+    run(incIntegerCounter1000000, "incIntegerCounter1000000", 100);
+    EXPECT_EQ(111000000, integer_counter0.value());
+  }
+
   // Test incrementing a gauge many times.
   IncDecGauge<0> gauge0("gauge0", "");
   void incGauge1000000(int threadid, int threadcount) {
@@ -68,6 +123,22 @@ namespace {
     EXPECT_EQ(111000000, gauge0.value());
   }
 
+  // Same as above, with a gauge stored as an integer.
+  IncDecGauge<0, int64_t> integer_gauge0("integer_gauge0", "");
+  void incIntegerGauge1000000(int threadid, int threadcount) {
+    for (int i = 0; i < 1000000; ++i) {
+      integer_gauge0.inc();
+    }
+  }
+  TEST_F(BenchmarkTest, IncIntegerGauge) {
+    run(incIntegerGauge1000000, "incIntegerGauge1000000", 1);
+    EXPECT_EQ(1000000, integer_gauge0.value());
+    run(incIntegerGauge1000000, "incIntegerGauge1000000", 10);
+    EXPECT_EQ(11000000, integer_gauge0.value());
+    run(incIntegerGauge1000000, "incIntegerGauge1000000", 100);
+    EXPECT_EQ(111000000, integer_gauge0.value());
+  }
+
   // Test setting a gauge many times.
   SetGauge<0> gauge1("gauge1", "");
   void setGauge1000000(int threadid, int threadcount) {
@@ -108,41 +179,451 @@ namespace {
     EXPECT_EQ(1, labelled_counter0.labels({"99", "100", "9999"}).value());
   }
 
+  // Test series coming and going: creating children and removing
+  // them, so that new children reuse the storage of removed ones.
+  Counter<2> churned_counter("churned_counter", "", {"threadid", "series"});
+  void churnLabels100x1000(int threadid, int threadcount) {
+    std::string threadid_str = std::to_string(threadid);
+    for (int j = 0; j < 100; ++j) {
+      for (int i = 0; i < 1000; ++i) {
+        churned_counter.labels({threadid_str, i}).inc();
+      }
+      for (int i = 0; i < 1000; ++i) {
+        churned_counter.remove({threadid_str, i});
+      }
+    }
+  }
+  TEST_F(BenchmarkTest, ChurnLabels) {
+    run(churnLabels100x1000, "churnLabels100x1000", 1);
+    run(churnLabels100x1000, "churnLabels100x1000", 10);
+    EXPECT_EQ(0U, churned_counter.size());
+  }
+
+  // Test collecting a metric with many children.
+  Counter<1> collected_counter("collected_counter", "", {"series"});
+  void collect100(int threadid, int threadcount) {
+    for (int i = 0; i < 100; ++i) {
+      client::MetricFamily mf;
+      collected_counter.collect(&mf);
+    }
+  }
+  TEST_F(BenchmarkTest, CollectLabels) {
+    for (int i = 0; i < 10000; ++i) {
+      collected_counter.labels({i}).inc();
+    }
+    run(collect100, "collect100x10000", 1);
+  }
+
+  // Test creating and removing children while the metric is scraped
+  // by another thread, to a sink that is slow to write some series
+  // (e.g. when a socket buffer is full). Children are only locked
+  // while collect() takes references on them, so the creations don't
+  // wait for the sink.
+  Counter<1> scraped_counter("scraped_counter", "", {"x"});
+  class SlowSink : public TextSink {
+   public:
+    explicit SlowSink(std::string* out) : TextSink(out), count_(0) {}
+    virtual void metric(Label const* labels, std::size_t count,
+                        util::string_view text_labels) {
+      if (++count_ % 1000 == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      TextSink::metric(labels, count, text_labels);
+    }
+
+   private:
+    std::size_t count_;
+  };
+  void createChildren1000(int threadid, int threadcount) {
+    for (int i = 0; i < 1000; ++i) {
+      scraped_counter.labels({"new" + std::to_string(i)}).inc();
+    }
+    for (int i = 0; i < 1000; ++i) {
+      scraped_counter.remove({"new" + std::to_string(i)});
+    }
+  }
+  TEST_F(BenchmarkTest, CreateWhileScraping) {
+    for (int i = 0; i < 100000; ++i) {
+      scraped_counter.labels({i}).inc();
+    }
+    run(createChildren1000, "createChildren1000", 1);
+    std::atomic<bool> done(false);
+    std::thread scraper([&done]() {
+      std::string buffer;
+      while (!done.load()) {
+        buffer.clear();
+        SlowSink sink(&buffer);
+        scraped_counter.collect(&sink);
+      }
+    });
+    run(createChildren1000, "createChildrenWhileScraping1000", 1);
+    done.store(true);
+    scraper.join();
+  }
+
+  // Test exposing a metric with many children in the text format,
+  // through protobufs and through a TextSink.
+  Counter<2> exposed_counter("exposed_counter", "A counter.",
+                             {"handler", "code"});
+  Histogram<1> exposed_histogram("exposed_histogram", "A histogram.",
+                                 {"handler"});
+  void exposeProto100(int threadid, int threadcount) {
+    for (int i = 0; i < 100; ++i) {
+      auto mf = std::make_shared<client::MetricFamily>();
+      exposed_counter.collect(mf.get());
+      std::string s = metricfamily_proto_to_string(mf);
+      mf = std::make_shared<client::MetricFamily>();
+      exposed_histogram.collect(mf.get());
+      s += metricfamily_proto_to_string(mf);
+    }
+  }
+  void exposeTextSink100(int threadid, int threadcount) {
+    std::string buffer;
+    for (int i = 0; i < 100; ++i) {
+      buffer.clear();
+      TextSink sink(&buffer);
+      exposed_counter.collect(&sink);
+      exposed_histogram.collect(&sink);
+    }
+  }
+  TEST_F(BenchmarkTest, ExposeText) {
+    for (int i = 0; i < 1000; ++i) {
+      exposed_counter.labels({"/handler/" + std::to_string(i), "200"}).inc(i);
+      exposed_histogram.labels({"/handler/" + std::to_string(i)}).observe(i);
+    }
+    run(exposeProto100, "exposeProto100", 1);
+    run(exposeTextSink100, "exposeTextSink100", 1);
+  }
+
+  // Test exposing 10000 series in the text format when only a
+  // fraction of them changed since the last scrape, with and without
+  // reusing the output of the unchanged series.
+  Histogram<1> scraped_histogram("scraped_histogram", "A histogram.",
+                                 {"handler"});
+  void scrape100(bool cache_series, int changed, int threadid,
+                 int threadcount) {
+    std::string buffer;
+    for (int i = 0; i < 100; ++i) {
+      for (int j = 0; j < changed; ++j) {
+        scraped_histogram.labels({j}).observe(i);
+      }
+      buffer.clear();
+      TextSink sink(&buffer, cache_series);
+      scraped_histogram.collect(&sink);
+    }
+  }
+  TEST_F(BenchmarkTest, ScrapeChangedSeries) {
+    for (int i = 0; i < 10000; ++i) {
+      scraped_histogram.labels({i}).observe(i);
+    }
+    for (int changed : {0, 100, 1000, 10000}) {
+      std::string suffix = "<" + std::to_string(changed) + " changed>";
+      run(std::bind(scrape100, false, changed, _1, _2),
+          "scrapeUncached100x10000" + suffix, 1);
+      run(std::bind(scrape100, true, changed, _1, _2),
+          "scrapeCached100x10000" + suffix, 1);
+    }
+  }
+
+  // Test escaping label values, most of which don't need escaping,
+  // as the text format does for every label of every series.
+  void escapeLabelValues1000000(int threadid, int threadcount) {
+    const std::vector<std::string> values = {
+        "GET", "200", "/api/v1/query_range", "us-east-1",
+        "a label value that is long enough to span a few blocks",
+        "C:\\Program Files\\app.exe", "line 1\nline 2",
+        "say \"hi\""};
+    std::string buffer;
+    for (int i = 0; i < 1000000; ++i) {
+      if (i % 1000 == 0) {
+        buffer.clear();
+      }
+      append_escaped_label_value(&buffer, values[i % values.size()]);
+    }
+  }
+  TEST_F(BenchmarkTest, EscapeLabelValues) {
+    run(escapeLabelValues1000000, "escapeLabelValues1000000", 1);
+  }
+
+  // Test formatting doubles as counters and gauges hold them: whole
+  // counts, byte totals, timestamps, durations and ratios.
+  const std::vector<double> formatted_values = {
+      0, 1, 42, 123456, 98765432101, 1.5e12, 1634567890.123, 0.25,
+      37.5, 0.003217, 123.456789, 0.1 + 0.2};
+  void formatDoublesSnprintf1000000(const char* format, int threadid,
+                                    int threadcount) {
+    char buffer[64];
+    for (int i = 0; i < 1000000; ++i) {
+      std::snprintf(buffer, sizeof(buffer), format,
+                    formatted_values[i % formatted_values.size()]);
+    }
+  }
+  void formatDoubles1000000(int threadid, int threadcount) {
+    char buffer[impl::kMaxDoubleLength];
+    for (int i = 0; i < 1000000; ++i) {
+      impl::format_double(formatted_values[i % formatted_values.size()],
+                          buffer);
+    }
+  }
+  TEST_F(BenchmarkTest, FormatDoubles) {
+    // "%g" is what the text format used to use, and "%.17g" always
+    // round-trips, but isn't the shortest.
+    run(std::bind(formatDoublesSnprintf1000000, "%g", _1, _2),
+        "formatDoubles1000000<%g>", 1);
+    run(std::bind(formatDoublesSnprintf1000000, "%.17g", _1, _2),
+        "formatDoubles1000000<%.17g>", 1);
+    run(formatDoubles1000000, "formatDoubles1000000<format_double>", 1);
+  }
+
+  // Test looking up a handful of existing children and performing an
+  // operation on them, as servers do when they resolve the same
+  // label sets for every request.
+  Counter<2> labelled_counter1("labelled_counter1", "", {"method", "code"});
+  void lookupLabelsAndInc1000000(int threadid, int threadcount) {
+    const std::array<std::string, 2> label_sets[] = {
+        {{"GET", "200"}}, {{"GET", "404"}}, {{"POST", "200"}},
+        {{"POST", "500"}}};
+    for (int i = 0; i < 1000000; ++i) {
+      labelled_counter1.labels(label_sets[i % 4]).inc();
+    }
+  }
+  // Same as above, with C strings and integers as label values, which
+  // don't need to be copied to std::strings.
+  void lookupLabelViewsAndInc1000000(int threadid, int threadcount) {
+    const char* methods[] = {"GET", "POST"};
+    const int codes[] = {200, 404, 200, 500};
+    for (int i = 0; i < 1000000; ++i) {
+      labelled_counter1.labels({methods[(i % 4) / 2], codes[i % 4]}).inc();
+    }
+  }
+  // Same as above, with handles looked up once per thread.
+  void incHandles1000000(int threadid, int threadcount) {
+    Counter<2>::Handle handles[] = {
+        labelled_counter1.handle({"GET", "200"}),
+        labelled_counter1.handle({"GET", "404"}),
+        labelled_counter1.handle({"POST", "200"}),
+        labelled_counter1.handle({"POST", "500"})};
+    for (int i = 0; i < 1000000; ++i) {
+      handles[i % 4]->inc();
+    }
+  }
+  // Same as above, with enumerated labels.
+  enum class Method { kGet, kPost };
+  EnumCounter<Method, int> enum_counter0(
+      "enum_counter0", "", EnumLabel<Method>("method", {"GET", "POST"}),
+      EnumLabel<int>("code", {"200", "404", "500"}));
+  void lookupEnumLabelsAndInc1000000(int threadid, int threadcount) {
+    const Method methods[] = {Method::kGet, Method::kPost};
+    const int codes[] = {0, 1, 0, 2};
+    for (int i = 0; i < 1000000; ++i) {
+      enum_counter0.labels(methods[(i % 4) / 2], codes[i % 4]).inc();
+    }
+  }
+  TEST_F(BenchmarkTest, LookupLabelsAndInc) {
+    run(lookupLabelsAndInc1000000, "lookupLabelsAndInc1000000", 1);
+    EXPECT_EQ(250000, labelled_counter1.labels({"GET", "200"}).value());
+    run(lookupLabelsAndInc1000000, "lookupLabelsAndInc1000000", 10);
+    EXPECT_EQ(2750000, labelled_counter1.labels({"GET", "200"}).value());
+    run(lookupLabelViewsAndInc1000000, "lookupLabelViewsAndInc1000000", 1);
+    EXPECT_EQ(3000000, labelled_counter1.labels({"GET", "200"}).value());
+    run(lookupLabelViewsAndInc1000000, "lookupLabelViewsAndInc1000000", 10);
+    EXPECT_EQ(5500000, labelled_counter1.labels({"GET", "200"}).value());
+    run(incHandles1000000, "incHandles1000000", 1);
+    EXPECT_EQ(5750000, labelled_counter1.labels({"GET", "200"}).value());
+    run(incHandles1000000, "incHandles1000000", 10);
+    EXPECT_EQ(8250000, labelled_counter1.labels({"GET", "200"}).value());
+    run(lookupEnumLabelsAndInc1000000, "lookupEnumLabelsAndInc1000000", 1);
+    EXPECT_EQ(250000, enum_counter0.labels(Method::kGet, 0).value());
+    run(lookupEnumLabelsAndInc1000000, "lookupEnumLabelsAndInc1000000", 10);
+    EXPECT_EQ(2750000, enum_counter0.labels(Method::kGet, 0).value());
+  }
+
+  // Test looking up many distinct sets of label values, to compare
+  // how the hash of the label values spreads realistic sets
+  // (method/code/path combinations) and adversarial ones: pairs of
+  // consecutive ids, the same pairs swapped, and repeated values,
+  // which weak combinations of per-value hashes map to few buckets.
+  typedef std::vector<std::array<std::string, 2>> labelsets_t;
+  labelsets_t realisticLabelSets() {
+    const char* methods[] = {"GET", "POST", "PUT", "DELETE"};
+    const char* codes[] = {"200", "201", "301", "404", "500"};
+    labelsets_t sets;
+    for (int path = 0; path < 500; ++path) {
+      for (const char* m : methods) {
+        for (const char* c : codes) {
+          sets.push_back({{std::string(m) + " /api/v1/item" +
+                               std::to_string(path), c}});
+        }
+      }
+    }
+    return sets;
+  }
+  labelsets_t adversarialLabelSets() {
+    labelsets_t sets;
+    for (int i = 0; i < 5000; ++i) {
+      sets.push_back({{std::to_string(i), std::to_string(i + 1)}});
+      sets.push_back({{std::to_string(i + 1), std::to_string(i)}});
+      sets.push_back({{std::to_string(i), std::to_string(i)}});
+    }
+    return sets;
+  }
+  Counter<2> realistic_counter("realistic_counter", "", {"request", "code"});
+  Counter<2> adversarial_counter("adversarial_counter", "", {"a", "b"});
+  void lookupLabelSets(Counter<2>* c, labelsets_t const* sets,
+                       int threadid, int threadcount) {
+    for (int i = 0; i < 100; ++i) {
+      for (auto const& labels : *sets) {
+        c->labels(labels).inc();
+      }
+    }
+  }
+  TEST_F(BenchmarkTest, LookupLabelSets) {
+    labelsets_t realistic = realisticLabelSets();
+    run(std::bind(lookupLabelSets, &realistic_counter, &realistic, _1, _2),
+        "lookupRealisticLabelSets10000x100", 1);
+    EXPECT_EQ(100, realistic_counter.labels(realistic[0]).value());
+    labelsets_t adversarial = adversarialLabelSets();
+    run(std::bind(lookupLabelSets, &adversarial_counter, &adversarial, _1, _2),
+        "lookupAdversarialLabelSets15000x100", 1);
+    EXPECT_EQ(100, adversarial_counter.labels({"1", "1"}).value());
+  }
+
   // Test observing pseudorandom values (with a fixed seed for
   // reproducibility). The distribution is passed as an argument, to
   // compare uniform distribution (cheaper) vs exponential
-  // distribution (more realistic).
+  // distribution (more realistic). The histogram is also passed as an
+  // argument, to compare layouts of various widths.
   Histogram<0> histogram0("histogram0", "");
-  template<typename distribution>
-  void observePseudoRandom100000(distribution& dis, int threadid, int threadcount) {
+  Histogram<0> histogram64("histogram64", "",
+                           histogram_levels_linear(0, 63, 16));
+  Histogram<0> histogram256("histogram256", "",
+                            histogram_levels_linear(0, 255, 4));
+  Histogram<0> histogram1024("histogram1024", "",
+                             histogram_levels_linear(0, 1023, 1));
+  Histogram<0> histogram_pow2("histogram_pow2", "",
+                              histogram_levels_powers_of(2, 40, -20));
+  Histogram<0, Batched> batched_histogram0("batched_histogram0", "");
+  template<typename H, typename distribution>
+  void observePseudoRandom100000(H* h, distribution& dis,
+                                 int threadid, int threadcount) {
     std::mt19937 prng(42);
     for (int i = 0; i < 100000; ++i) {
       double d = dis(prng);
-      histogram0.observe(d);
+      h->observe(d);
     }
   }
+  template <typename H>
+  void runHistogram(H* h, std::string const& name) {
+    typedef std::uniform_real_distribution<double> uniform_t;
+    typedef std::exponential_distribution<double> exponential_t;
+    uniform_t uniform(0.0, 1024.0);
+    run(std::bind(observePseudoRandom100000<H, uniform_t>, h, uniform, _1, _2),
+        name + "<uniform>", 1);
+    EXPECT_EQ(100000, h->value());
+    run(std::bind(observePseudoRandom100000<H, uniform_t>, h, uniform, _1, _2),
+        name + "<uniform>", 10);
+    EXPECT_EQ(11*100000, h->value());
+    run(std::bind(observePseudoRandom100000<H, uniform_t>, h, uniform, _1, _2),
+        name + "<uniform>", 100);
+    EXPECT_EQ(111*100000, h->value());
+
+    exponential_t exponential(1.0);
+    run(std::bind(observePseudoRandom100000<H, exponential_t>, h, exponential, _1, _2),
+        name + "<exponential>", 1);
+    EXPECT_EQ(112*100000, h->value());
+    run(std::bind(observePseudoRandom100000<H, exponential_t>, h, exponential, _1, _2),
+        name + "<exponential>", 10);
+    EXPECT_EQ(122*100000, h->value());
+    run(std::bind(observePseudoRandom100000<H, exponential_t>, h, exponential, _1, _2),
+        name + "<exponential>", 100);
+    EXPECT_EQ(222*100000, h->value());
+  }
   TEST_F(BenchmarkTest, Histogram) {
-    std::uniform_real_distribution<double> uniform(0.0, 1024.0);
-    run(std::bind(observePseudoRandom100000<std::uniform_real_distribution<double>>, uniform, _1, _2),
-        "observepseudorandom100000<uniform>", 1);
-    EXPECT_EQ(100000, histogram0.value());
-    run(std::bind(observePseudoRandom100000<std::uniform_real_distribution<double>>, uniform, _1, _2),
-        "observepseudorandom100000<uniform>", 10);
-    EXPECT_EQ(11*100000, histogram0.value());
-    run(std::bind(observePseudoRandom100000<std::uniform_real_distribution<double>>, uniform, _1, _2),
-        "observepseudorandom100000<uniform>", 100);
-    EXPECT_EQ(111*100000, histogram0.value());
+    runHistogram(&histogram0, "observepseudorandom100000_15buckets");
+    runHistogram(&histogram64, "observepseudorandom100000_64buckets");
+    runHistogram(&histogram256, "observepseudorandom100000_256buckets");
+    runHistogram(&histogram1024, "observepseudorandom100000_1024buckets");
+    runHistogram(&histogram_pow2, "observepseudorandom100000_pow2buckets");
+    runHistogram(&batched_histogram0,
+                 "observepseudorandom100000_15buckets_batched");
+  }
 
+  // Test observing pseudorandom values in a summary.
+  Summary<0> summary0("summary0", "");
+  void observeSummary100000(int threadid, int threadcount) {
+    std::mt19937 prng(42);
+    std::exponential_distribution<double> exponential(1.0);
+    for (int i = 0; i < 100000; ++i) {
+      summary0.observe(exponential(prng));
+    }
+  }
+  TEST_F(BenchmarkTest, Summary) {
+    run(observeSummary100000, "observeSummary100000<exponential>", 1);
+    EXPECT_EQ(100000, summary0.value());
+    run(observeSummary100000, "observeSummary100000<exponential>", 10);
+    EXPECT_EQ(11*100000, summary0.value());
+    run(observeSummary100000, "observeSummary100000<exponential>", 100);
+    EXPECT_EQ(111*100000, summary0.value());
+  }
+
+  SparseHistogram<0> sparse_histogram0("sparse_histogram0", "");
+  void observeSparseHistogram100000(int threadid, int threadcount) {
+    std::mt19937 prng(42);
     std::exponential_distribution<double> exponential(1.0);
-    run(std::bind(observePseudoRandom100000<std::exponential_distribution<double>>, exponential, _1, _2),
-        "observepseudorandom100000<exponential>", 1);
-    EXPECT_EQ(112*100000, histogram0.value());
-    run(std::bind(observePseudoRandom100000<std::exponential_distribution<double>>, exponential, _1, _2),
-        "observepseudorandom100000<exponential>", 10);
-    EXPECT_EQ(122*100000, histogram0.value());
-    run(std::bind(observePseudoRandom100000<std::exponential_distribution<double>>, exponential, _1, _2),
-        "observepseudorandom100000<exponential>", 100);
-    EXPECT_EQ(222*100000, histogram0.value());
+    for (int i = 0; i < 100000; ++i) {
+      sparse_histogram0.observe(exponential(prng));
+    }
+  }
+  TEST_F(BenchmarkTest, SparseHistogram) {
+    run(observeSparseHistogram100000,
+        "observeSparseHistogram100000<exponential>", 1);
+    EXPECT_EQ(100000, sparse_histogram0.value());
+    run(observeSparseHistogram100000,
+        "observeSparseHistogram100000<exponential>", 10);
+    EXPECT_EQ(11*100000, sparse_histogram0.value());
+  }
+
+  // Test each bucket search implementation supported by this CPU on
+  // layouts of various widths, with uniformly distributed values.
+  void searchBuckets1000000(impl::bucket_search_fn search,
+                            std::vector<double> const* levels,
+                            int threadid, int threadcount) {
+    std::mt19937 prng(42);
+    std::uniform_real_distribution<double> uniform(0.0, levels->back());
+    std::size_t total = 0;
+    for (int i = 0; i < 1000000; ++i) {
+      total += search(levels->data(), levels->size(), uniform(prng));
+    }
+    EXPECT_LE(total, 1000000 * levels->size());
+  }
+  TEST_F(BenchmarkTest, BucketSearch) {
+    for (int count : {15, 64, 256}) {
+      std::vector<double> levels = histogram_levels_linear(0, count, 1);
+      levels.pop_back();
+      for (auto const& impl : impl::supported_bucket_searches()) {
+        run(std::bind(searchBuckets1000000, impl.second, &levels, _1, _2),
+            "searchBuckets1000000<" + impl.first + "," +
+            std::to_string(count) + ">", 1);
+      }
+    }
+  }
+
+  // Test constructing many metrics, as the static initialization of
+  // a binary with thousands of global metrics does. The metrics are
+  // registered with the global collector, so they are never
+  // destroyed.
+  void constructMetrics3000(int threadid, int threadcount) {
+    for (int i = 0; i < 1000; ++i) {
+      std::string suffix = std::to_string(threadid) + "_" + std::to_string(i);
+      new Counter<0>("startup_counter_" + suffix, "A counter.");
+      new Counter<2>("startup_labelled_counter_" + suffix, "A counter.",
+                     {"method", "code"});
+      new Histogram<1>("startup_histogram_" + suffix, "A histogram.",
+                       {"handler"});
+    }
+  }
+  TEST_F(BenchmarkTest, ConstructMetrics) {
+    run(constructMetrics3000, "constructMetrics3000", 1);
   }
 
 }
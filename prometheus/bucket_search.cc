@@ -0,0 +1,94 @@
+#include "bucket_search.hh"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PROMETHEUS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace prometheus {
+  namespace impl {
+
+    std::size_t bucket_search_scalar(double const* levels, std::size_t count,
+                                     double v) {
+      for (std::size_t i = 0; i < count; ++i) {
+        if (v <= levels[i]) {
+          return i;
+        }
+      }
+      return count;
+    }
+
+#ifdef PROMETHEUS_X86_SIMD
+
+    // The vectorized searches compare v against several levels at
+    // once with a "not less-or-equal" comparison, which is true for
+    // levels below v as well as for NaN. Since levels are sorted, the
+    // resulting mask is a run of ones followed by zeros, and the
+    // number of trailing ones is the number of levels below v. The
+    // search stops at the first block that isn't entirely below v.
+
+    __attribute__((target("sse2")))
+    std::size_t bucket_search_sse2(double const* levels, std::size_t count,
+                                   double v) {
+      const __m128d vv = _mm_set1_pd(v);
+      std::size_t i = 0;
+      for (; i + 4 <= count; i += 4) {
+        int lo = _mm_movemask_pd(_mm_cmpnle_pd(vv, _mm_loadu_pd(levels + i)));
+        int hi =
+            _mm_movemask_pd(_mm_cmpnle_pd(vv, _mm_loadu_pd(levels + i + 2)));
+        int mask = lo | (hi << 2);
+        if (mask != 0xf) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i + bucket_search_scalar(levels + i, count - i, v);
+    }
+
+    __attribute__((target("avx2")))
+    std::size_t bucket_search_avx2(double const* levels, std::size_t count,
+                                   double v) {
+      const __m256d vv = _mm256_set1_pd(v);
+      std::size_t i = 0;
+      for (; i + 8 <= count; i += 8) {
+        int lo = _mm256_movemask_pd(
+            _mm256_cmp_pd(vv, _mm256_loadu_pd(levels + i), _CMP_NLE_UQ));
+        int hi = _mm256_movemask_pd(
+            _mm256_cmp_pd(vv, _mm256_loadu_pd(levels + i + 4), _CMP_NLE_UQ));
+        int mask = lo | (hi << 4);
+        if (mask != 0xff) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i + bucket_search_sse2(levels + i, count - i, v);
+    }
+
+#endif  /* PROMETHEUS_X86_SIMD */
+
+    std::vector<std::pair<std::string, bucket_search_fn>>
+    supported_bucket_searches() {
+      std::vector<std::pair<std::string, bucket_search_fn>> v;
+      v.push_back(std::make_pair("scalar", &bucket_search_scalar));
+#ifdef PROMETHEUS_X86_SIMD
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("sse2")) {
+        v.push_back(std::make_pair("sse2", &bucket_search_sse2));
+        if (__builtin_cpu_supports("avx2")) {
+          v.push_back(std::make_pair("avx2", &bucket_search_avx2));
+        }
+      }
+#endif
+      return v;
+    }
+
+    bucket_search_fn best_bucket_search() {
+      static const bucket_search_fn best =
+          supported_bucket_searches().back().second;
+      return best;
+    }
+
+  } /* namespace impl */
+} /* namespace prometheus */
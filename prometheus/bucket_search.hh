@@ -0,0 +1,36 @@
+#ifndef PROMETHEUS_BUCKET_SEARCH_HH__
+#define PROMETHEUS_BUCKET_SEARCH_HH__
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace prometheus {
+  namespace impl {
+
+    // A bucket search function returns the index of the first of the
+    // `count` sorted levels that is superior or equal to `v`, or
+    // `count` if there is none. NaN is never inferior or equal to a
+    // level, so it maps to `count`.
+    typedef std::size_t (*bucket_search_fn)(double const* levels,
+                                            std::size_t count, double v);
+
+    // Plain linear search, available on all platforms.
+    std::size_t bucket_search_scalar(double const* levels, std::size_t count,
+                                     double v);
+
+    // Returns the fastest bucket search function supported by the
+    // CPU we're running on. The choice is made once per process.
+    bucket_search_fn best_bucket_search();
+
+    // Returns all bucket search functions supported by the CPU we're
+    // running on, with a name for each. This is useful for testing
+    // and benchmarking.
+    std::vector<std::pair<std::string, bucket_search_fn>>
+    supported_bucket_searches();
+
+  } /* namespace impl */
+} /* namespace prometheus */
+
+#endif
@@ -3,16 +3,75 @@
 
 #include "exceptions.hh"
 #include "metrics.hh"
+#include "names.hh"
 #include "registry.hh"
 #include "util/extend_array.hh"
 #include "values.hh"
 
 #include <array>
+#include <chrono>
 #include <string>
 #include <vector>
 
 namespace prometheus {
 
+  // Counter representations. A Counter<N> stores its value in a
+  // single atomic double. Counter<N, Sharded> spreads increments
+  // over per-thread cells to avoid contention on heavily incremented
+  // counters (see impl::ShardedCounterValue). Counter<N, T> with an
+  // integral type T (e.g. uint64_t) stores an integer, which is
+  // cheaper to increment than a double.
+  //
+  // Similarly, IncDecGauge<N> stores a double and IncDecGauge<N, T>
+  // with an integral T (e.g. int64_t) stores an integer.
+  //
+  // Counter<N, Batched> and Histogram<N, Batched> accumulate updates
+  // in per-thread cells that are merged when the metric is read or
+  // collected (see impl::BatchedCounterValue). They are the cheapest
+  // to update, for metrics updated in tight loops by a few
+  // long-lived threads.
+  struct Sharded {};
+  struct Batched {};
+
+  namespace impl {
+    template <typename Repr>
+    struct counter_value {
+      typedef IntegerCounterValue<Repr> type;
+    };
+    template <>
+    struct counter_value<double> {
+      typedef CounterValue type;
+    };
+    template <>
+    struct counter_value<Sharded> {
+      typedef ShardedCounterValue type;
+    };
+    template <>
+    struct counter_value<Batched> {
+      typedef BatchedCounterValue type;
+    };
+
+    template <typename Repr>
+    struct histogram_value;
+    template <>
+    struct histogram_value<double> {
+      typedef HistogramValue type;
+    };
+    template <>
+    struct histogram_value<Batched> {
+      typedef BatchedHistogramValue type;
+    };
+
+    template <typename Repr>
+    struct incdec_gauge_value {
+      typedef IntegerIncDecGaugeValue<Repr> type;
+    };
+    template <>
+    struct incdec_gauge_value<double> {
+      typedef IncDecGaugeValue type;
+    };
+  } /* namespace impl */
+
   template <int N>
   class SetGauge : public impl::LabeledMetric<N, impl::SetGaugeValue> {
     using impl::LabeledMetric<N, impl::SetGaugeValue>::LabeledMetric;
@@ -22,33 +81,98 @@ namespace prometheus {
     using impl::UnlabeledMetric<impl::SetGaugeValue>::UnlabeledMetric;
   };
 
-  template <int N>
-  class IncDecGauge : public impl::LabeledMetric<N, impl::IncDecGaugeValue> {
-    using impl::LabeledMetric<N, impl::IncDecGaugeValue>::LabeledMetric;
+  template <int N, typename Repr = double>
+  class IncDecGauge : public impl::LabeledMetric<
+                          N, typename impl::incdec_gauge_value<Repr>::type> {
+    typedef typename impl::incdec_gauge_value<Repr>::type value_type;
+    using impl::LabeledMetric<N, value_type>::LabeledMetric;
   };
-  template <>
-  class IncDecGauge<0> : public impl::UnlabeledMetric<impl::IncDecGaugeValue> {
-    using impl::UnlabeledMetric<impl::IncDecGaugeValue>::UnlabeledMetric;
+  template <typename Repr>
+  class IncDecGauge<0, Repr>
+      : public impl::UnlabeledMetric<
+            typename impl::incdec_gauge_value<Repr>::type> {
+    typedef typename impl::incdec_gauge_value<Repr>::type value_type;
+    using impl::UnlabeledMetric<value_type>::UnlabeledMetric;
   };
 
-  template <int N>
-  class Counter : public impl::LabeledMetric<N, impl::CounterValue> {
-    using impl::LabeledMetric<N, impl::CounterValue>::LabeledMetric;
+  template <int N, typename Repr = double>
+  class Counter : public impl::LabeledMetric<
+                      N, typename impl::counter_value<Repr>::type> {
+    typedef typename impl::counter_value<Repr>::type value_type;
+    using impl::LabeledMetric<N, value_type>::LabeledMetric;
   };
-  template <>
-  class Counter<0> : public impl::UnlabeledMetric<impl::CounterValue> {
-    using impl::UnlabeledMetric<impl::CounterValue>::UnlabeledMetric;
+  template <typename Repr>
+  class Counter<0, Repr> : public impl::UnlabeledMetric<
+                               typename impl::counter_value<Repr>::type> {
+    typedef typename impl::counter_value<Repr>::type value_type;
+    using impl::UnlabeledMetric<value_type>::UnlabeledMetric;
+  };
+
+  template <int N, typename Repr = double>
+  class Histogram : public impl::LabeledMetric<
+                        N, typename impl::histogram_value<Repr>::type> {
+    typedef typename impl::histogram_value<Repr>::type value_type;
+    using impl::LabeledMetric<N, value_type>::LabeledMetric;
+  };
+  template <typename Repr>
+  class Histogram<0, Repr> : public impl::UnlabeledMetric<
+                                 typename impl::histogram_value<Repr>::type> {
+    typedef typename impl::histogram_value<Repr>::type value_type;
+    using impl::UnlabeledMetric<value_type>::UnlabeledMetric;
   };
 
   template <int N>
-  class Histogram : public impl::LabeledMetric<N, impl::HistogramValue> {
-    using impl::LabeledMetric<N, impl::HistogramValue>::LabeledMetric;
+  class SparseHistogram
+      : public impl::LabeledMetric<N, impl::SparseHistogramValue> {
+    using impl::LabeledMetric<N, impl::SparseHistogramValue>::LabeledMetric;
   };
   template <>
-  class Histogram<0> : public impl::UnlabeledMetric<impl::HistogramValue> {
-    using impl::UnlabeledMetric<impl::HistogramValue>::UnlabeledMetric;
+  class SparseHistogram<0>
+      : public impl::UnlabeledMetric<impl::SparseHistogramValue> {
+    using impl::UnlabeledMetric<impl::SparseHistogramValue>::UnlabeledMetric;
   };
 
+  // clock_t drives the sliding window of quantiles (see
+  // impl::BasicSummaryValue) as well as idle eviction.
+  template <int N, typename clock_t = std::chrono::steady_clock>
+  class Summary : public impl::LabeledMetric<
+                      N, impl::BasicSummaryValue<clock_t>, clock_t> {
+    using impl::LabeledMetric<N, impl::BasicSummaryValue<clock_t>,
+                              clock_t>::LabeledMetric;
+  };
+  template <typename clock_t>
+  class Summary<0, clock_t>
+      : public impl::UnlabeledMetric<impl::BasicSummaryValue<clock_t>> {
+    using impl::UnlabeledMetric<
+        impl::BasicSummaryValue<clock_t>>::UnlabeledMetric;
+  };
+
+  // Metrics whose labels all have small fixed domains, declared with
+  // one EnumLabel per label, e.g.:
+  //
+  //   enum class Method { kGet, kPost };
+  //   EnumCounter<Method, int> requests(
+  //       "requests_total", "Requests.",
+  //       EnumLabel<Method>("method", {"GET", "POST"}),
+  //       EnumLabel<int>::range("shard", 16));
+  //   requests.labels(Method::kPost, 3).inc();
+  //
+  // Children are stored in a dense array (see
+  // impl::EnumLabeledMetric).
+  template <typename... Labels>
+  using EnumCounter = impl::EnumLabeledMetric<impl::CounterValue, Labels...>;
+  template <typename... Labels>
+  using EnumSetGauge =
+      impl::EnumLabeledMetric<impl::SetGaugeValue, Labels...>;
+  template <typename... Labels>
+  using EnumIncDecGauge =
+      impl::EnumLabeledMetric<impl::IncDecGaugeValue, Labels...>;
+  template <typename... Labels>
+  using EnumHistogram =
+      impl::EnumLabeledMetric<impl::HistogramValue, Labels...>;
+  template <typename... Labels>
+  using EnumSummary = impl::EnumLabeledMetric<impl::SummaryValue, Labels...>;
+
 } /* namespace prometheus */
 
 #endif /* PROMETHEUS_CLIENT_HH__ */
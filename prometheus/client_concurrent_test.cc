@@ -1,9 +1,15 @@
 #include "client.hh"
+#include "registry.hh"
+#include "sink.hh"
 #include "utils.hh"
+#include "prometheus/proto/metrics.pb.h"
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
 #include <list>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace {
 
@@ -37,6 +43,86 @@ namespace {
     EXPECT_EQ(kThreads * kIterations / 2, c1.labels({{"1"}}).value());
   }
 
+  Counter<0, Sharded> sc0("test_sharded_counter0", "Test Counter<0, Sharded>.");
+  Counter<1, Sharded> sc1("test_sharded_counter1", "Test Counter<1, Sharded>.",
+                          {{"even"}});
+
+  void f_shardedcountertest(int threadid) {
+    for (int i = 0; i < kIterations; ++i) {
+      sc0.inc();
+      sc1.labels({{std::to_string(bool(threadid % 2))}}).inc();
+    }
+  }
+
+  TEST_F(ClientConcurrentTest, ShardedCounterTest) {
+    std::list<std::thread> l;
+    for (int i = 0; i < kThreads; ++i) {
+      l.push_back(std::thread(f_shardedcountertest, i));
+    }
+    for (auto& t : l) {
+      t.join();
+    }
+    EXPECT_EQ(kThreads * kIterations, sc0.value());
+    EXPECT_EQ(kThreads * kIterations / 2, sc1.labels({{"0"}}).value());
+    EXPECT_EQ(kThreads * kIterations / 2, sc1.labels({{"1"}}).value());
+  }
+
+  Counter<0, Batched> bc0("test_batched_counter0", "Test Counter<0, Batched>.");
+  Histogram<1, Batched> bh1("test_batched_histogram1",
+                            "Test Histogram<1, Batched>.", {{"even"}});
+
+  void f_batchedtest(int threadid) {
+    std::string even = std::to_string(bool(threadid % 2));
+    for (int i = 0; i < kIterations; ++i) {
+      bc0.inc();
+      bh1.labels({even}).observe(i);
+    }
+  }
+
+  TEST_F(ClientConcurrentTest, BatchedValuesTest) {
+    std::list<std::thread> l;
+    for (int i = 0; i < kThreads; ++i) {
+      l.push_back(std::thread(f_batchedtest, i));
+    }
+    // Collections may run while threads are updating the values.
+    for (int i = 0; i < 10; ++i) {
+      EXPECT_LE(bc0.value(), kThreads * kIterations);
+    }
+    for (auto& t : l) {
+      t.join();
+    }
+    EXPECT_EQ(kThreads * kIterations, bc0.value());
+    EXPECT_EQ(kThreads * kIterations / 2, bh1.labels({"0"}).value());
+    EXPECT_EQ(kThreads * kIterations / 2, bh1.labels({"1"}).value());
+  }
+
+  Counter<0, uint64_t> ic0("test_integer_counter0",
+                           "Test Counter<0, uint64_t>.");
+  IncDecGauge<1, int64_t> iidg1("test_integer_incdec_gauge1",
+                                "Test IncDecGauge<1, int64_t>.", {"even"});
+
+  void f_integertest(int threadid) {
+    std::string even = std::to_string(bool(threadid % 2));
+    for (int i = 0; i < kIterations; ++i) {
+      ic0.inc();
+      iidg1.labels({even}).inc(2);
+      iidg1.labels({even}).dec();
+    }
+  }
+
+  TEST_F(ClientConcurrentTest, IntegerValuesTest) {
+    std::list<std::thread> l;
+    for (int i = 0; i < kThreads; ++i) {
+      l.push_back(std::thread(f_integertest, i));
+    }
+    for (auto& t : l) {
+      t.join();
+    }
+    EXPECT_EQ(kThreads * kIterations, ic0.value());
+    EXPECT_EQ(kThreads * kIterations / 2, iidg1.labels({"0"}).value());
+    EXPECT_EQ(kThreads * kIterations / 2, iidg1.labels({"1"}).value());
+  }
+
   SetGauge<0> sg0("test_set_gauge0", "Test SetGauge<0>.");
   SetGauge<1> sg1("test_set_gauge1", "Test SetGauge<1>.", {{"even"}});
 
@@ -130,4 +216,201 @@ namespace {
       EXPECT_EQ(kThreads, h1a.labels({std::to_string(i)}).value());
     }
   }
+
+  Counter<2> c2("test_counter2", "Test Counter<2>.", {"threadgroup", "i"});
+
+  void f_labelstest(int threadid) {
+    std::string threadgroup = std::to_string(threadid % 4);
+    for (int i = 0; i < kIterations; ++i) {
+      c2.labels({threadgroup, std::to_string(i % 100)}).inc();
+    }
+  }
+
+  TEST_F(ClientConcurrentTest, LabelsWhileCollectingTest) {
+    std::list<std::thread> l;
+    for (int i = 0; i < kThreads; ++i) {
+      l.push_back(std::thread(f_labelstest, i));
+    }
+    // Collections run concurrently with lookups and creations of
+    // children.
+    for (int i = 0; i < 10; ++i) {
+      impl::global_registry.collect();
+    }
+    for (auto& t : l) {
+      t.join();
+    }
+    for (auto g : {"0", "1", "2", "3"}) {
+      for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(kIterations * kThreads / 4 / 100,
+                  c2.labels({g, std::to_string(i)}).value());
+      }
+    }
+  }
+
+  // A clock that only moves when the test steps it, and that can be
+  // read from any thread.
+  struct StepClock {
+    typedef std::chrono::nanoseconds duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<StepClock> time_point;
+    static const bool is_steady = true;
+    static time_point now() { return time_point(duration(ticks.load())); }
+    static void step(duration d) { ticks.fetch_add(d.count()); }
+    static std::atomic<rep> ticks;
+  };
+  std::atomic<StepClock::rep> StepClock::ticks(0);
+
+  impl::LabeledMetric<1, impl::CounterValue, StepClock> c_idle(
+      "test_counter_idle", "Test LabeledMetric with max_idle.", {"i"});
+
+  void f_idletest(std::atomic<int>* running) {
+    // Each label value is updated less often than collections run,
+    // so most lookups find a child that the next collection evicts.
+    // The reference is held for a short while (much less than the
+    // time between collections) before it is used.
+    for (int i = 0; i < 2000; ++i) {
+      auto& value = c_idle.labels({std::to_string(i % 100)});
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      value.inc();
+    }
+    running->fetch_sub(1);
+  }
+
+  TEST_F(ClientConcurrentTest, IdleEvictionTest) {
+    c_idle.set_max_idle(std::chrono::seconds(1));
+    const int kUpdaters = 2;
+    std::atomic<int> running(kUpdaters);
+    std::list<std::thread> l;
+    for (int i = 0; i < kUpdaters; ++i) {
+      l.push_back(std::thread(f_idletest, &running));
+    }
+    // Each collection happens max_idle after the previous one, so it
+    // evicts the children that didn't change in between, while
+    // references on them are in use. Evicted children must outlive
+    // these references.
+    while (running.load() > 0) {
+      StepClock::step(std::chrono::seconds(1));
+      client::MetricFamily mf;
+      c_idle.collect(&mf);
+      EXPECT_LE(mf.metric_size(), 100);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (auto& t : l) {
+      t.join();
+    }
+  }
+
+  Summary<1> s1("test_summary1", "Test Summary<1>", {"threadgroup"});
+
+  void f_summarytest(int threadid) {
+    std::string threadgroup = std::to_string(threadid % 4);
+    for (int i = 0; i < kIterations; ++i) {
+      s1.labels({threadgroup}).observe(i);
+    }
+  }
+
+  TEST_F(ClientConcurrentTest, SummaryTest) {
+    std::list<std::thread> l;
+    for (int i = 0; i < kThreads; ++i) {
+      l.push_back(std::thread(f_summarytest, i));
+    }
+    for (auto& t : l) {
+      t.join();
+    }
+    for (auto g : {"0", "1", "2", "3"}) {
+      EXPECT_EQ(kIterations * kThreads / 4, s1.labels({g}).value());
+      EXPECT_NEAR(kIterations / 2, s1.labels({g}).quantile(0.5),
+                  kIterations * 0.02);
+    }
+  }
+
+  // A collector that takes some time to build a single family.
+  class SlowCollector : public ICollector {
+   public:
+    SlowCollector(std::string const& name, std::chrono::milliseconds delay)
+        : name_(name), delay_(delay), calls_(0) {}
+
+    collection_type collect() const {
+      calls_.fetch_add(1);
+      std::this_thread::sleep_for(delay_);
+      collection_type v;
+      v.push_back(MetricFamilyPtr(new client::MetricFamily));
+      v.back()->set_name(name_);
+      v.back()->set_help("help");
+      v.back()->set_type(client::MetricType::GAUGE);
+      v.back()->add_metric()->mutable_gauge()->set_value(1);
+      return v;
+    }
+
+    int calls() const { return calls_.load(); }
+
+   private:
+    std::string name_;
+    std::chrono::milliseconds delay_;
+    mutable std::atomic<int> calls_;
+  };
+
+  std::vector<std::string> names(collection_type const& families) {
+    std::vector<std::string> v;
+    for (auto const& f : families) {
+      v.push_back(f->name());
+    }
+    return v;
+  }
+
+  double collection_timeouts() {
+    for (auto const& f : impl::global_registry.collect()) {
+      if (f->name() == "prometheus_client_collection_timeouts_total") {
+        return f->metric(0).counter().value();
+      }
+    }
+    return -1;
+  }
+
+  TEST_F(ClientConcurrentTest, ParallelCollectionTest) {
+    SlowCollector fast1("fast1", std::chrono::milliseconds(0));
+    SlowCollector slow("slow", std::chrono::milliseconds(500));
+    SlowCollector fast2("fast2", std::chrono::milliseconds(10));
+    impl::CollectorRegistry registry;
+    registry.register_collector(&fast1);
+    registry.register_collector(&slow);
+    registry.register_collector(&fast2);
+    EXPECT_EQ((std::vector<std::string>{"fast2", "slow", "fast1"}),
+              names(registry.collect()));
+
+    double timeouts = collection_timeouts();
+    registry.set_parallel_collection(
+        impl::CollectorRegistry::thread_per_task_executor(),
+        std::chrono::milliseconds(200));
+    // The slow collector misses its deadline, and the others are
+    // merged in the same order as sequentially.
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ((std::vector<std::string>{"fast2", "fast1"}),
+              names(registry.collect()));
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::milliseconds(450));
+    collection_type v;
+    impl::ProtobufSink sink(&v);
+    registry.collect(&sink);
+    EXPECT_EQ((std::vector<std::string>{"fast2", "fast1"}), names(v));
+    EXPECT_EQ(timeouts + 2, collection_timeouts());
+    // The slow collector got no new task while its first one was
+    // running late.
+    EXPECT_EQ(2, slow.calls());
+    // Once that task returns, it gets new tasks again.
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    EXPECT_EQ((std::vector<std::string>{"fast2", "fast1"}),
+              names(registry.collect()));
+    EXPECT_EQ(3, slow.calls());
+    EXPECT_EQ(timeouts + 3, collection_timeouts());
+
+    // Waits for the late tasks of the slow collector.
+    registry.unregister_collector(&slow);
+    EXPECT_EQ((std::vector<std::string>{"fast2", "fast1"}),
+              names(registry.collect()));
+    EXPECT_EQ(timeouts + 3, collection_timeouts());
+    registry.unregister_collector(&fast1);
+    registry.unregister_collector(&fast2);
+  }
 }
@@ -48,10 +48,9 @@ int main() {
   unicode.labels({u8"valüe"}).inc();
   unicode.labels({u8"🍌"}).inc(2);
 
-  auto v = prometheus::impl::global_registry.collect();
-  for (auto m : v) {
-    std::string s;
-    std::cout << prometheus::metricfamily_proto_to_string(m);
-  }
+  std::string s;
+  prometheus::TextSink sink(&s);
+  prometheus::impl::global_registry.collect(&sink);
+  std::cout << s;
   return 0;
 }
@@ -3,10 +3,22 @@
 // This is a test of all basic functionalities of the C++ Prometheus
 // client library.
 
+#include "bucket_search.hh"
 #include "client.hh"
+#include "registry.hh"
+#include "slab.hh"
 #include "utils.hh"
 #include "external/fake_clock/fake_clock.hh"
+#include "prometheus/proto/metrics.pb.h"
+#include <cmath>
+#include <limits>
+#include <random>
+#include <set>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
 #include <gtest/gtest.h>
 
 namespace {
@@ -44,6 +56,107 @@ namespace {
     EXPECT_NO_THROW(c0.inc(0));
   }
 
+  Counter<0, Sharded> sc0("test_sharded_counter0", "test Counter<0, Sharded>");
+  Counter<1, Sharded> sc1("test_sharded_counter1", "test Counter<1, Sharded>",
+                          {{"x"}});
+
+  TEST_F(ClientCPPTest, ShardedCounterTest) {
+    EXPECT_EQ(0, sc0.value());
+    EXPECT_EQ(0, sc1.labels({"a"}).value());
+
+    sc0.inc();
+    sc0.inc(2.5);
+    sc1.labels({"b"}).inc(2.3);
+    EXPECT_EQ(3.5, sc0.value());
+    EXPECT_EQ(0, sc1.labels({"a"}).value());
+    EXPECT_EQ(2.3, sc1.labels({"b"}).value());
+
+    EXPECT_THROW(sc0.inc(-1), err::NegativeCounterIncrementException);
+    EXPECT_EQ(3.5, sc0.value());
+  }
+
+  Counter<0, Batched> bc0("test_batched_counter0", "test Counter<0, Batched>");
+  Counter<1, Batched> bc1("test_batched_counter1", "test Counter<1, Batched>",
+                          {{"x"}});
+
+  TEST_F(ClientCPPTest, BatchedCounterTest) {
+    EXPECT_EQ(0, bc0.value());
+    EXPECT_EQ(0, bc1.labels({"a"}).value());
+
+    bc0.inc();
+    bc0.inc(2.5);
+    bc1.labels({"b"}).inc(2.3);
+    EXPECT_EQ(3.5, bc0.value());
+    EXPECT_EQ(0, bc1.labels({"a"}).value());
+    EXPECT_EQ(2.3, bc1.labels({"b"}).value());
+
+    EXPECT_THROW(bc0.inc(-1), err::NegativeCounterIncrementException);
+    EXPECT_EQ(3.5, bc0.value());
+
+    // Increments of exited threads are kept.
+    std::thread([] { bc0.inc(4); }).join();
+    EXPECT_EQ(7.5, bc0.value());
+  }
+
+  TEST_F(ClientCPPTest, BatchedCounterRemovalTest) {
+    // Ids of removed values are reused by new values. A thread that
+    // used the removed value must not write to its stale cell.
+    bc1.labels({"c"}).inc(1);
+    bc1.remove({"c"});
+    bc1.labels({"d"}).inc(2);
+    EXPECT_EQ(2, bc1.labels({"d"}).value());
+    EXPECT_EQ(0, bc1.labels({"c"}).value());
+  }
+
+  Counter<0, uint64_t> ic0("test_integer_counter0",
+                           "test Counter<0, uint64_t>");
+  Counter<1, int64_t> ic1("test_integer_counter1", "test Counter<1, int64_t>",
+                          {{"x"}});
+
+  // Whether V::inc() accepts an argument of type U.
+  template <typename V, typename U, typename = void>
+  struct accepts_inc : std::false_type {};
+  template <typename V, typename U>
+  struct accepts_inc<V, U,
+                     decltype(std::declval<V&>().inc(std::declval<U>()))>
+      : std::true_type {};
+
+  // Whether V::dec() accepts an argument of type U.
+  template <typename V, typename U, typename = void>
+  struct accepts_dec : std::false_type {};
+  template <typename V, typename U>
+  struct accepts_dec<V, U,
+                     decltype(std::declval<V&>().dec(std::declval<U>()))>
+      : std::true_type {};
+
+  TEST_F(ClientCPPTest, IntegerCounterTest) {
+    EXPECT_EQ(0, ic0.value());
+    EXPECT_EQ(0, ic1.labels({"a"}).value());
+
+    ic0.inc();
+    ic0.inc(uint64_t(1) << 60);
+    ic1.labels({"b"}).inc(3);
+    EXPECT_EQ(double((uint64_t(1) << 60) + 1), ic0.value());
+    EXPECT_EQ(0, ic1.labels({"a"}).value());
+    EXPECT_EQ(3, ic1.labels({"b"}).value());
+
+    // Decrementing a signed integer counter throws.
+    EXPECT_THROW(ic1.labels({"b"}).inc(-1),
+                 err::NegativeCounterIncrementException);
+    EXPECT_EQ(3, ic1.labels({"b"}).value());
+    // So does decrementing an unsigned one, as the value is checked
+    // before it is converted.
+    double before = ic0.value();
+    EXPECT_THROW(ic0.inc(-1), err::NegativeCounterIncrementException);
+    EXPECT_THROW(ic0.inc(int64_t(-5)), err::NegativeCounterIncrementException);
+    EXPECT_EQ(before, ic0.value());
+
+    // Fractional increments don't compile.
+    static_assert(accepts_inc<Counter<0, uint64_t>, int>::value, "");
+    static_assert(!accepts_inc<Counter<0, uint64_t>, double>::value, "");
+    static_assert(!accepts_inc<Counter<0, int64_t>, float>::value, "");
+  }
+
   SetGauge<0> sg0("test_set_gauge0", "test SetGauge<0>");
   SetGauge<1> sg1("test_set_gauge1", "test SetGauge<1>", {{"x"}});
   SetGauge<2> sg2("test_set_gauge2", "test SetGauge<2>", {"x", "y"});
@@ -103,6 +216,33 @@ namespace {
     EXPECT_EQ(2.4, idg2.labels({"c", "c"}).value());
   }
 
+  IncDecGauge<0, int64_t> iidg0("test_integer_incdec_gauge0",
+                                "test IncDecGauge<0, int64_t>");
+  IncDecGauge<1, int64_t> iidg1("test_integer_incdec_gauge1",
+                                "test IncDecGauge<1, int64_t>", {{"x"}});
+
+  TEST_F(ClientCPPTest, IntegerIncDecGaugeTest) {
+    EXPECT_EQ(0, iidg0.value());
+    EXPECT_EQ(0, iidg1.labels({"a"}).value());
+
+    iidg0.inc(4);
+    iidg0.dec();
+    iidg1.labels({"b"}).dec(7);
+    EXPECT_EQ(3, iidg0.value());
+    EXPECT_EQ(0, iidg1.labels({"a"}).value());
+    EXPECT_EQ(-7, iidg1.labels({"b"}).value());
+
+    iidg0.dec(uint8_t(5));
+    iidg0.inc(int64_t(-1));
+    EXPECT_EQ(-3, iidg0.value());
+
+    // Fractional updates don't compile.
+    static_assert(accepts_inc<IncDecGauge<0, int64_t>, int>::value, "");
+    static_assert(!accepts_inc<IncDecGauge<0, int64_t>, double>::value, "");
+    static_assert(accepts_dec<IncDecGauge<0, int64_t>, unsigned>::value, "");
+    static_assert(!accepts_dec<IncDecGauge<0, int32_t>, float>::value, "");
+  }
+
   Histogram<0> h0("test_histogram0", "test Histogram<0>");
   Histogram<0> h0a("test_histogram0a", "test Histogram<0> with custom levels",
                    histogram_levels({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, kInf}));
@@ -145,6 +285,55 @@ namespace {
     EXPECT_EQ(2, h0b.value(kInf));
   }
 
+  Histogram<0> h0_nan("test_histogram0_nan", "test Histogram<0> with NaN",
+                      histogram_levels({1, 2}));
+
+  TEST_F(ClientCPPTest, HistogramNaNTest) {
+    h0_nan.observe(0.5);
+    h0_nan.observe(std::nan(""));
+    EXPECT_EQ(1, h0_nan.value(1));
+    EXPECT_EQ(1, h0_nan.value(2));
+    EXPECT_EQ(2, h0_nan.value());
+  }
+
+  Histogram<1, Batched> bh1("test_batched_histogram1",
+                            "test Histogram<1, Batched>", {{"x"}},
+                            histogram_levels({1, 2}));
+
+  TEST_F(ClientCPPTest, BatchedHistogramTest) {
+    bh1.labels({"a"}).observe(0.5);
+    bh1.labels({"a"}).observe(1.5);
+    std::thread([] { bh1.labels({"a"}).observe(3); }).join();
+    EXPECT_EQ(1, bh1.labels({"a"}).value(1));
+    EXPECT_EQ(2, bh1.labels({"a"}).value(2));
+    EXPECT_EQ(3, bh1.labels({"a"}).value());
+    EXPECT_EQ(0, bh1.labels({"b"}).value());
+    EXPECT_EQ(bh1.labels({"a"}).layout(), bh1.labels({"b"}).layout());
+  }
+
+  // Updates batched values from the destructor of a thread_local.
+  struct UpdateOnThreadExit {
+    ~UpdateOnThreadExit() {
+      bc0.inc(1);
+      bh1.labels({"exit"}).observe(0.5);
+    }
+  };
+
+  TEST_F(ClientCPPTest, BatchedThreadExitTest) {
+    double before = bc0.value();
+    std::thread([] {
+      // Constructed before the table of cells of the thread, so
+      // destroyed after it: its updates go to the retired totals.
+      thread_local UpdateOnThreadExit update;
+      (void)update;
+      bc0.inc(1);
+      bh1.labels({"exit"}).observe(1.5);
+    }).join();
+    EXPECT_EQ(before + 2, bc0.value());
+    EXPECT_EQ(1, bh1.labels({"exit"}).value(1));
+    EXPECT_EQ(2, bh1.labels({"exit"}).value());
+  }
+
   TEST_F(ClientCPPTest, LabelledHistogramTest) {
     h1.labels({"a"}).observe(4.2);
     h1.labels({"b"}).observe(4.6);
@@ -159,6 +348,214 @@ namespace {
 
     EXPECT_EQ(1, h1.labels({"a"}).value(kInf));
     EXPECT_EQ(2, h1.labels({"b"}).value(kInf));
+
+    // All children share the same bucket layout.
+    EXPECT_EQ(h1.labels({"a"}).layout(), h1.labels({"b"}).layout());
+  }
+
+  Summary<0> s0("test_summary0", "test Summary<0>");
+  Summary<1> s1("test_summary1", "test Summary<1>", {{"x"}},
+                summary_quantiles({0, 0.25, 1}));
+
+  TEST_F(ClientCPPTest, SummaryTest) {
+    EXPECT_TRUE(std::isnan(s0.quantile(0.5)));
+    for (int i = 1; i <= 1000; ++i) {
+      s0.observe(i);
+    }
+    EXPECT_EQ(1000, s0.value());
+    EXPECT_EQ(500500, s0.sum());
+    // Quantiles are within 1/(2*kSubBuckets) of the exact value.
+    const double error = 1.0 / (2 * impl::SummaryValue::kSubBuckets);
+    EXPECT_NEAR(500, s0.quantile(0.5), 500 * error);
+    EXPECT_NEAR(900, s0.quantile(0.9), 900 * error);
+    EXPECT_NEAR(990, s0.quantile(0.99), 990 * error);
+    EXPECT_NEAR(1, s0.quantile(0), error);
+    EXPECT_NEAR(1000, s0.quantile(1), 1000 * error);
+
+    s1.labels({"a"}).observe(-4);
+    s1.labels({"a"}).observe(0);
+    s1.labels({"a"}).observe(1e-30);
+    s1.labels({"a"}).observe(3);
+    EXPECT_EQ(4, s1.labels({"a"}).value());
+    EXPECT_EQ(0, s1.labels({"b"}).value());
+    EXPECT_NEAR(-4, s1.labels({"a"}).quantile(0), 4 * error);
+    EXPECT_EQ(0, s1.labels({"a"}).quantile(0.5));
+    // Values too small to be tracked are counted as 0.
+    EXPECT_EQ(0, s1.labels({"a"}).quantile(0.75));
+    EXPECT_NEAR(3, s1.labels({"a"}).quantile(1), 3 * error);
+  }
+
+  TEST_F(ClientCPPTest, SummaryMaxAgeTest) {
+    Summary<0, testing::fake_clock> s("test_summary_max_age", "",
+                                      default_summary_quantiles,
+                                      std::chrono::milliseconds(200), 2);
+    s.observe(1);
+    EXPECT_NEAR(1, s.quantile(0.5), 0.05);
+    testing::fake_clock::advance(std::chrono::milliseconds(100));
+    // The observation is still within max_age.
+    EXPECT_NEAR(1, s.quantile(0.5), 0.05);
+    testing::fake_clock::advance(std::chrono::milliseconds(200));
+    // The observation is too old to be counted in quantiles, but it
+    // is still counted in the sum and count.
+    EXPECT_TRUE(std::isnan(s.quantile(0.5)));
+    EXPECT_EQ(1, s.value());
+    s.observe(2);
+    EXPECT_NEAR(2, s.quantile(0.5), 0.1);
+  }
+
+  TEST_F(ClientCPPTest, BadSummaryQuantilesTest) {
+    EXPECT_THROW(new Summary<0>("test", "test", summary_quantiles({1.5})),
+                 err::InvalidQuantileException);
+    EXPECT_THROW(new Summary<0>("test", "test", summary_quantiles({-0.1})),
+                 err::InvalidQuantileException);
+  }
+
+  TEST_F(ClientCPPTest, SparseHistogramIndexTest) {
+    typedef impl::SparseHistogramValue V;
+    for (int s = V::kMinSchema; s <= V::kMaxSchema; ++s) {
+      for (int i = -100; i <= 100; ++i) {
+        double upper = V::bucket_upper_bound(i, s);
+        if (upper == 0 || std::isinf(upper)) {
+          continue;
+        }
+        // Buckets include their upper bound but not their lower bound.
+        EXPECT_EQ(i, V::bucket_index(upper, s)) << i << " " << s;
+        EXPECT_EQ(i + 1, V::bucket_index(std::nextafter(upper, kInf), s))
+            << i << " " << s;
+      }
+    }
+    EXPECT_EQ(0, V::bucket_index(1, 0));
+    EXPECT_EQ(1, V::bucket_index(1.5, 0));
+    EXPECT_EQ(1, V::bucket_index(2, 0));
+    EXPECT_EQ(-1, V::bucket_index(0.5, 0));
+    EXPECT_EQ(1, V::bucket_index(3, -1));
+    EXPECT_EQ(2, V::bucket_index(5, -1));
+  }
+
+  SparseHistogram<0> sh0("test_sparse_histogram0", "test SparseHistogram<0>");
+  SparseHistogram<1> sh1("test_sparse_histogram1", "test SparseHistogram<1>",
+                         {{"x"}}, 3, 8);
+
+  TEST_F(ClientCPPTest, SparseHistogramTest) {
+    sh0.observe(1);
+    sh0.observe(-1);
+    sh0.observe(0);
+    sh0.observe(std::nan(""));
+    EXPECT_EQ(4, sh0.value());
+    EXPECT_EQ(2, sh0.bucket_count());
+    EXPECT_EQ(3, sh0.schema());
+
+    for (int i = 0; i < 1000; ++i) {
+      sh1.labels({"a"}).observe(std::ldexp(1.0, i % 20));
+    }
+    // Resolution was reduced until the 20 distinct values fit in 8
+    // buckets.
+    EXPECT_EQ(1000, sh1.labels({"a"}).value());
+    EXPECT_LE(sh1.labels({"a"}).bucket_count(), 8);
+    EXPECT_EQ(-2, sh1.labels({"a"}).schema());
+    EXPECT_EQ(3, sh1.labels({"b"}).schema());
+  }
+
+  // Checks that each bucket of a collected sparse histogram counts
+  // exactly the observed values that are <= its upper bound.
+  void expect_le_buckets(SparseHistogram<0> const& h,
+                         std::vector<double> const& observed) {
+    client::MetricFamily mf;
+    h.collect(&mf);
+    ASSERT_EQ(1, mf.metric_size());
+    for (auto const& b : mf.metric(0).histogram().bucket()) {
+      uint64_t n = 0;
+      for (double v : observed) {
+        n += v <= b.upper_bound();
+      }
+      EXPECT_EQ(n, b.cumulative_count()) << "le=" << b.upper_bound();
+    }
+  }
+
+  SparseHistogram<0> sh_schema0("test_sparse_histogram_schema0", "", 0);
+  SparseHistogram<0> sh_schema3("test_sparse_histogram_schema3", "", 3);
+
+  TEST_F(ClientCPPTest, SparseHistogramNegativeBoundsTest) {
+    typedef impl::SparseHistogramValue V;
+    // Exact negative powers of the base are on bucket boundaries.
+    std::vector<double> observed0, observed3;
+    for (int i = -2; i <= 3; ++i) {
+      observed0.push_back(-V::bucket_upper_bound(i, 0));
+    }
+    for (int i = -3; i <= 10; ++i) {
+      observed3.push_back(-V::bucket_upper_bound(i, 3));
+    }
+    for (double v : observed0) {
+      sh_schema0.observe(v);
+    }
+    for (double v : observed3) {
+      sh_schema3.observe(v);
+    }
+    expect_le_buckets(sh_schema0, observed0);
+    expect_le_buckets(sh_schema3, observed3);
+  }
+
+  TEST_F(ClientCPPTest, BadSparseHistogramTest) {
+    EXPECT_THROW(new SparseHistogram<0>("test", "test", 9), std::logic_error);
+    EXPECT_THROW(new SparseHistogram<0>("test", "test", 3, 0),
+                 std::logic_error);
+    EXPECT_THROW(new SparseHistogram<0>("test", "test", 3, 10, -1),
+                 std::logic_error);
+  }
+
+  enum class Method { kGet, kPost, kPut };
+  EnumCounter<Method, int> ec("enum_counter", "",
+                              EnumLabel<Method>("method", {"GET", "POST", "PUT"}),
+                              EnumLabel<int>::range("shard", 4));
+  EnumHistogram<Method> eh("enum_histogram", "",
+                           EnumLabel<Method>("method", {"GET", "POST", "PUT"}),
+                           histogram_levels({1, 2}));
+
+  TEST_F(ClientCPPTest, EnumLabelsTest) {
+    ec.labels(Method::kPost, 3).inc();
+    ec.labels(Method::kPut, 0).inc(2);
+    EXPECT_EQ(1, ec.labels(Method::kPost, 3).value());
+    EXPECT_EQ(2, ec.labels(Method::kPut, 0).value());
+    EXPECT_EQ(0, ec.labels(Method::kGet, 3).value());
+    EXPECT_NE(&ec.labels(Method::kPost, 3), &ec.labels(Method::kPut, 3));
+    EXPECT_THROW(ec.labels(Method::kGet, 4), err::InvalidLabelValueException);
+    EXPECT_THROW(ec.labels(Method::kGet, -1),
+                 err::InvalidLabelValueException);
+    EXPECT_THROW(ec.labels(static_cast<Method>(3), 0),
+                 err::InvalidLabelValueException);
+
+    eh.labels(Method::kGet).observe(1.5);
+    EXPECT_EQ(1, eh.labels(Method::kGet).value(2));
+    EXPECT_EQ(0, eh.labels(Method::kGet).value(1));
+    EXPECT_EQ(eh.labels(Method::kGet).layout(),
+              eh.labels(Method::kPut).layout());
+
+    EXPECT_THROW(new EnumCounter<Method>("test", "",
+                                         EnumLabel<Method>("le", {"GET"})),
+                 err::InvalidNameException);
+  }
+
+  Counter<2> c_lv("counter_label_values", "", {"x", "y"});
+
+  TEST_F(ClientCPPTest, LabelValuesTest) {
+    // Strings, C strings, string views and integers name the same
+    // children.
+    std::string a("a");
+    c_lv.labels({a, std::string("1")}).inc();
+    c_lv.labels({"a", 1}).inc();
+    c_lv.labels({util::string_view("ab", 1), uint64_t(1)}).inc();
+    c_lv.labels(std::array<std::string, 2>{{"a", "1"}}).inc();
+    EXPECT_EQ(4, c_lv.labels({"a", "1"}).value());
+
+    c_lv.labels({"b", -42}).inc();
+    EXPECT_EQ(1, c_lv.labels({"b", "-42"}).value());
+    c_lv.labels({"b", std::numeric_limits<int64_t>::min()}).inc();
+    EXPECT_EQ(1, c_lv.labels({"b", "-9223372036854775808"}).value());
+    c_lv.labels({"b", std::numeric_limits<uint64_t>::max()}).inc();
+    EXPECT_EQ(1, c_lv.labels({"b", "18446744073709551615"}).value());
+
+    c_lv.remove({"b", -42});
+    EXPECT_EQ(0, c_lv.labels({"b", "-42"}).value());
   }
 
   Counter<2> c_rem("counter_removal", "", {"x", "y"});
@@ -194,6 +591,521 @@ namespace {
     EXPECT_EQ(0, c_rem.labels({"b", "d"}).value());
   }
 
+  Counter<1> c_interned("counter_interned", "", {"x"});
+
+  TEST_F(ClientCPPTest, InternedStringTest) {
+    std::size_t size = impl::InternedString::pool_size();
+    {
+      impl::InternedString a(std::string("interned_a"));
+      impl::InternedString a2("interned_a");
+      impl::InternedString b("interned_b");
+      EXPECT_EQ(size + 2, impl::InternedString::pool_size());
+      EXPECT_EQ(a, a2);
+      EXPECT_EQ(a.view().data(), a2.view().data());
+      EXPECT_NE(a, b);
+      EXPECT_EQ("interned_b", b.str());
+
+      impl::InternedString a3(a);
+      a2 = b;
+      EXPECT_EQ(a, a3);
+      EXPECT_EQ(b, a2);
+      EXPECT_EQ(size + 2, impl::InternedString::pool_size());
+
+      EXPECT_EQ("", impl::InternedString("").str());
+      EXPECT_EQ(impl::InternedString(), impl::InternedString(""));
+    }
+    // Strings leave the pool with their last reference.
+    EXPECT_EQ(size, impl::InternedString::pool_size());
+
+    // Label values are interned.
+    c_interned.labels({"interned_c"}).inc();
+    EXPECT_EQ(size + 1, impl::InternedString::pool_size());
+    c_interned.remove({"interned_c"});
+    EXPECT_EQ(size, impl::InternedString::pool_size());
+  }
+
+  Counter<1> c_handle("counter_handle", "", {"x"});
+
+  TEST_F(ClientCPPTest, LabelHashTest) {
+    // Swapped, shifted and repeated label values, and values split
+    // at different places, all hash differently.
+    typedef std::array<std::string, 2> labels_t;
+    util::ContainerHash<labels_t> hash;
+    std::unordered_set<std::size_t> hashes;
+    for (int i = 0; i < 10000; ++i) {
+      hashes.insert(hash({{std::to_string(i), std::to_string(i + 1)}}));
+      hashes.insert(hash({{std::to_string(i + 1), std::to_string(i)}}));
+      hashes.insert(hash({{std::to_string(i), std::to_string(i)}}));
+    }
+    EXPECT_EQ(30000U, hashes.size());
+    EXPECT_NE(hash({{"ab", "c"}}), hash({{"a", "bc"}}));
+    EXPECT_NE(hash({{"", "abc"}}), hash({{"abc", ""}}));
+    EXPECT_NE(hash({{"abcdefgh", "i"}}), hash({{"abcdefghi", ""}}));
+  }
+
+  TEST_F(ClientCPPTest, HandleTest) {
+    Counter<1>::Handle a = c_handle.handle({"a"});
+    Counter<1>::Handle b = c_handle.handle({"b"});
+    a->inc();
+    EXPECT_EQ(1, c_handle.labels({"a"}).value());
+    EXPECT_EQ(&c_handle.labels({"a"}), &*a);
+
+    // Handles stay valid after their child is removed, but the child
+    // is detached from the metric.
+    c_handle.remove({"a"});
+    a->inc();
+    EXPECT_EQ(2, a->value());
+    EXPECT_EQ(0, c_handle.labels({"a"}).value());
+    EXPECT_NE(&c_handle.labels({"a"}), &*a);
+
+    b->inc(3);
+    c_handle.clear();
+    b->inc(3);
+    EXPECT_EQ(6, b->value());
+    EXPECT_EQ(0, c_handle.labels({"b"}).value());
+
+    Counter<1>::Handle empty;
+    EXPECT_FALSE(empty);
+    EXPECT_TRUE(b);
+  }
+
+  Counter<1> c_limited("counter_limited", "", {"user"});
+
+  TEST_F(ClientCPPTest, CardinalityLimitTest) {
+    c_limited.set_max_children(2);
+    c_limited.labels({"a"}).inc();
+    c_limited.labels({"b"}).inc();
+    EXPECT_EQ(0U, c_limited.overflow_count());
+    // New label values past the limit all go to the overflow child.
+    c_limited.labels({"c"}).inc();
+    c_limited.labels({"d"}).inc(2);
+    EXPECT_EQ(2U, c_limited.overflow_count());
+    EXPECT_EQ(3U, c_limited.size());
+    EXPECT_EQ(3, c_limited.labels({Counter<1>::kOverflowLabelValue}).value());
+    EXPECT_EQ(&c_limited.labels({"e"}),
+              &c_limited.labels({Counter<1>::kOverflowLabelValue}));
+    // Existing children are still updated.
+    c_limited.labels({"a"}).inc();
+    EXPECT_EQ(2, c_limited.labels({"a"}).value());
+
+    c_limited.remove({"a"});
+    c_limited.remove({Counter<1>::kOverflowLabelValue});
+    EXPECT_EQ(1U, c_limited.size());
+    c_limited.labels({"f"}).inc();
+    EXPECT_EQ(1, c_limited.labels({"f"}).value());
+    EXPECT_EQ(2U, c_limited.size());
+
+    c_limited.set_max_children(0);
+    c_limited.labels({"g"}).inc();
+    EXPECT_EQ(3U, c_limited.size());
+  }
+
+  impl::LabeledMetric<1, impl::CounterValue, testing::fake_clock> c_idle(
+      "counter_idle", "", {"x"});
+
+  TEST_F(ClientCPPTest, IdleEvictionTest) {
+    c_idle.set_max_idle(std::chrono::milliseconds(200));
+    c_idle.labels({"busy"}).inc();
+    c_idle.labels({"idle"}).inc();
+    // Children with handles on them are never evicted.
+    auto pinned = c_idle.handle({"pinned"});
+    pinned->inc();
+    {
+      client::MetricFamily mf;
+      c_idle.collect(&mf);
+      EXPECT_EQ(3, mf.metric_size());
+    }
+    testing::fake_clock::advance(std::chrono::milliseconds(100));
+    c_idle.labels({"busy"}).inc();
+    {
+      // No child has been idle for max_idle yet.
+      client::MetricFamily mf;
+      c_idle.collect(&mf);
+      EXPECT_EQ(3, mf.metric_size());
+    }
+    testing::fake_clock::advance(std::chrono::milliseconds(200));
+    c_idle.labels({"busy"}).inc();
+    auto& idle = c_idle.labels({"idle"});
+    {
+      client::MetricFamily mf;
+      c_idle.collect(&mf);
+      ASSERT_EQ(2, mf.metric_size());
+      std::set<std::string> collected;
+      for (auto const& m : mf.metric()) {
+        collected.insert(m.label(0).value());
+      }
+      EXPECT_EQ(std::set<std::string>({"busy", "pinned"}), collected);
+    }
+    EXPECT_EQ(2U, c_idle.size());
+    // The evicted child outlives references taken before its
+    // eviction for max_idle.
+    EXPECT_EQ(1, idle.value());
+    EXPECT_EQ(0, c_idle.labels({"idle"}).value());
+  }
+
+  class ProtobufOnlyCollector : public ICollector {
+   public:
+    explicit ProtobufOnlyCollector(std::string const& name) : name_(name) {}
+
+    collection_type collect() const {
+      collection_type v;
+      v.push_back(MetricFamilyPtr(new client::MetricFamily));
+      v.back()->set_name(name_);
+      v.back()->set_help("help");
+      v.back()->set_type(client::MetricType::GAUGE);
+      v.back()->add_metric()->mutable_gauge()->set_value(3);
+      return v;
+    }
+
+   private:
+    std::string name_;
+  };
+
+  TEST_F(ClientCPPTest, SinkTest) {
+    // Collectors that only build protobufs can be collected to a
+    // sink, in the same order as with collect().
+    ProtobufOnlyCollector c1("first"), c2("second");
+    impl::CollectorRegistry registry;
+    registry.register_collector(&c1);
+    registry.register_collector(&c2);
+    collection_type expected = registry.collect();
+    collection_type v;
+    impl::ProtobufSink sink(&v);
+    registry.collect(&sink);
+    ASSERT_EQ(2U, v.size());
+    for (auto it = v.begin(), it_expected = expected.begin(); it != v.end();
+         ++it, ++it_expected) {
+      EXPECT_EQ((*it_expected)->SerializeAsString(), (*it)->SerializeAsString());
+    }
+    registry.unregister_collector(&c1);
+    registry.unregister_collector(&c2);
+  }
+
+  // Records the labels rendered for the text format passed to
+  // metric().
+  class TextLabelsSink : public MetricSink {
+   public:
+    virtual void family(std::string const& /*name*/,
+                        std::string const& /*help*/, MetricType /*type*/) {}
+    virtual void metric(Label const* /*labels*/, std::size_t /*count*/,
+                        util::string_view text_labels) {
+      text_labels_.insert(text_labels.to_string());
+    }
+    virtual void value(double /*value*/) {}
+    virtual void bucket(double /*upper_bound*/,
+                        uint64_t /*cumulative_count*/) {}
+    virtual void histogram(uint64_t /*count*/, double /*sum*/) {}
+    virtual void quantile(double /*quantile*/, double /*value*/) {}
+    virtual void summary(uint64_t /*count*/, double /*sum*/) {}
+
+    std::set<std::string> text_labels_;
+  };
+
+  Counter<2> c_text_labels("counter_text_labels", "", {"x", "y"});
+
+  TEST_F(ClientCPPTest, TextLabelsTest) {
+    c_text_labels.labels({"a", "b"}).inc();
+    c_text_labels.labels({"\"quoted\"", "back\\slash\n"}).inc();
+    {
+      TextLabelsSink sink;
+      c_text_labels.collect(&sink);
+      EXPECT_EQ((std::set<std::string>{
+                    "x=\"a\",y=\"b\"",
+                    "x=\"\\\"quoted\\\"\",y=\"back\\\\slash\\n\""}),
+                sink.text_labels_);
+    }
+    {
+      TextLabelsSink sink;
+      ec.collect(&sink);
+      EXPECT_EQ(3U * 4U, sink.text_labels_.size());
+      EXPECT_EQ(1U, sink.text_labels_.count("method=\"POST\",shard=\"3\""));
+    }
+  }
+
+  // Writes the labels and values of each series on a line, and
+  // caches the output of series like TextSink.
+  class CachingSink : public MetricSink {
+   public:
+    virtual void family(std::string const& /*name*/,
+                        std::string const& /*help*/, MetricType /*type*/) {}
+    virtual void metric(Label const* /*labels*/, std::size_t /*count*/,
+                        util::string_view text_labels) {
+      ++written_;
+      out_.append(1, '\n').append(text_labels.data(), text_labels.size());
+    }
+    virtual void value(double value) { append(value); }
+    virtual void bucket(double /*upper_bound*/, uint64_t cumulative_count) {
+      append(cumulative_count);
+    }
+    virtual void histogram(uint64_t count, double sum) {
+      append(count);
+      append(sum);
+    }
+    virtual void quantile(double /*quantile*/, double value) { append(value); }
+    virtual void summary(uint64_t count, double sum) {
+      append(count);
+      append(sum);
+    }
+
+    virtual bool caches_series() const { return true; }
+    virtual bool write_cached_series(SeriesCache const* cache,
+                                     uint64_t fingerprint) {
+      if (cache->format == &kFormat && cache->fingerprint == fingerprint) {
+        out_.append(cache->output);
+        return true;
+      }
+      start_ = out_.size();
+      return false;
+    }
+    virtual void cache_series(SeriesCache* cache, uint64_t fingerprint) {
+      cache->format = &kFormat;
+      cache->fingerprint = fingerprint;
+      cache->output = out_.substr(start_);
+    }
+
+    std::string out_;
+    int written_ = 0;
+
+   private:
+    static const char kFormat;
+    void append(double d) { out_.append(1, ' ').append(std::to_string(d)); }
+    std::size_t start_ = 0;
+  };
+
+  const char CachingSink::kFormat = 0;
+
+  // The same output, without caching.
+  class UncachedSink : public CachingSink {
+   public:
+    virtual bool caches_series() const { return false; }
+  };
+
+  Counter<1> c_cached("counter_series_cache", "", {"x"});
+
+  TEST_F(ClientCPPTest, SeriesCacheTest) {
+    for (int i = 0; i < 10; ++i) {
+      c_cached.labels({i}).inc(i);
+    }
+    CachingSink first;
+    c_cached.collect(&first);
+    EXPECT_EQ(10, first.written_);
+    // Series whose values didn't change are not written again.
+    CachingSink second;
+    c_cached.collect(&second);
+    EXPECT_EQ(0, second.written_);
+    EXPECT_EQ(first.out_, second.out_);
+
+    c_cached.labels({3}).inc();
+    c_cached.labels({"new"}).inc();
+    CachingSink third;
+    c_cached.collect(&third);
+    EXPECT_EQ(2, third.written_);
+    UncachedSink uncached;
+    c_cached.collect(&uncached);
+    EXPECT_EQ(11, uncached.written_);
+    EXPECT_EQ(uncached.out_, third.out_);
+
+    // Other sinks don't use the caches.
+    client::MetricFamily mf;
+    c_cached.collect(&mf);
+    EXPECT_EQ(11, mf.metric_size());
+
+    CachingSink enum_first;
+    eh.collect(&enum_first);
+    EXPECT_EQ(3, enum_first.written_);
+    eh.labels(Method::kPut).observe(0.5);
+    CachingSink enum_second;
+    eh.collect(&enum_second);
+    EXPECT_EQ(1, enum_second.written_);
+    UncachedSink enum_uncached;
+    eh.collect(&enum_uncached);
+    EXPECT_EQ(enum_uncached.out_, enum_second.out_);
+  }
+
+  Counter<1> c_mutated("counter_mutated_while_collecting", "", {"x"});
+
+  // Creates and removes children of c_mutated when the first metric is
+  // written to it.
+  template <class Sink>
+  class MutatingSink : public Sink {
+   public:
+    virtual void metric(MetricSink::Label const* labels, std::size_t count,
+                        util::string_view text_labels) {
+      if (this->written_ == 0) {
+        c_mutated.clear();
+        for (int i = 0; i < 100; ++i) {
+          c_mutated.labels({"new" + std::to_string(i)}).inc();
+        }
+      }
+      Sink::metric(labels, count, text_labels);
+    }
+  };
+
+  template <class Sink>
+  void expect_collected_while_mutating() {
+    c_mutated.clear();
+    for (int i = 0; i < 100; ++i) {
+      c_mutated.labels({i}).inc(i + 1);
+    }
+    MutatingSink<Sink> sink;
+    c_mutated.collect(&sink);
+    EXPECT_EQ(100, sink.written_);
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_NE(std::string::npos,
+                sink.out_.find("\nx=\"" + std::to_string(i) + "\" " +
+                               std::to_string(i + 1) + ".000000"));
+    }
+    EXPECT_EQ(100U, c_mutated.size());
+    EXPECT_EQ(1, c_mutated.labels({"new0"}).value());
+  }
+
+  TEST_F(ClientCPPTest, MutateWhileCollectingTest) {
+    // Children are written without holding the locks of the metric,
+    // so the sink can create and remove children. The children that
+    // existed when the collection started are written, even if they
+    // are removed in the meantime, and only them.
+    expect_collected_while_mutating<UncachedSink>();
+    expect_collected_while_mutating<CachingSink>();
+  }
+
+  TEST_F(ClientCPPTest, SlabTest) {
+    impl::Slab<int>* slab = new impl::Slab<int>;
+    int* a = slab->create(1);
+    int* b = slab->create(2);
+    impl::Slab<int>::attach(a);
+    impl::Slab<int>::attach(b);
+    impl::Slab<int>::slot(b)->acquire();
+    std::vector<int> attached;
+    slab->for_each_attached([&](int i) { attached.push_back(i); });
+    EXPECT_EQ(std::vector<int>({1, 2}), attached);
+
+    // Chunks grow as objects are created, and objects are still
+    // visited in memory order.
+    std::vector<int*> more;
+    for (int i = 0; i < 100; ++i) {
+      more.push_back(slab->create(10 + i));
+      impl::Slab<int>::attach(more.back());
+    }
+    attached.clear();
+    slab->for_each_attached([&](int i) { attached.push_back(i); });
+    ASSERT_EQ(102U, attached.size());
+    EXPECT_EQ(2, attached[1]);
+    EXPECT_EQ(109, attached.back());
+    for (int* i : more) {
+      impl::Slab<int>::detach(i);
+      impl::Slab<int>::slot(i)->release();
+    }
+
+    // Released slots are reused.
+    impl::Slab<int>::detach(a);
+    impl::Slab<int>::slot(a)->release();
+    EXPECT_EQ(a, slab->create(3));
+    impl::Slab<int>::slot(a)->release();
+
+    // Objects outlive the owner of their slab.
+    slab->release_slab();
+    impl::Slab<int>::slot(b)->release();
+    EXPECT_EQ(2, *b);
+    impl::Slab<int>::slot(b)->release();
+  }
+
+  TEST_F(ClientCPPTest, SlabIndexTest) {
+    // Hashes collide on their low bits, so that erasing entries
+    // moves the following ones back.
+    std::vector<int> objects(100);
+    impl::SlabIndex<int> index;
+    auto hash = [](int i) -> std::size_t { return (i % 3) << 10 | (i % 7); };
+    for (int i = 0; i < 100; ++i) {
+      objects[i] = i;
+      index.insert(hash(i), &objects[i]);
+    }
+    for (int i = 0; i < 100; i += 2) {
+      index.erase(hash(i), &objects[i]);
+    }
+    EXPECT_EQ(50U, index.size());
+    for (int i = 0; i < 100; ++i) {
+      int* found = index.find(hash(i), [i](int j) { return i == j; });
+      EXPECT_EQ(i % 2 == 0 ? nullptr : &objects[i], found);
+    }
+    int cleared = 0;
+    index.clear([&](int*) { ++cleared; });
+    EXPECT_EQ(50, cleared);
+    EXPECT_EQ(nullptr, index.find(hash(1), [](int) { return true; }));
+  }
+
+  TEST_F(ClientCPPTest, BucketSearchTest) {
+    // All bucket search implementations must agree with the scalar
+    // one, including on block boundaries, exact matches and NaN.
+    std::mt19937 prng(42);
+    std::uniform_real_distribution<double> dis(-10.0, 300.0);
+    std::vector<double> probes = {-kInf, kInf, std::nan(""), -0.0};
+    for (int i = 0; i < 1000; ++i) {
+      probes.push_back(dis(prng));
+    }
+    for (auto const& impl : impl::supported_bucket_searches()) {
+      for (int count = 0; count < 40; ++count) {
+        std::vector<double> levels;
+        for (int i = 0; i < count; ++i) {
+          levels.push_back(i * 7.0);
+          probes.push_back(i * 7.0);
+        }
+        for (double p : probes) {
+          EXPECT_EQ(impl::bucket_search_scalar(levels.data(), count, p),
+                    impl.second(levels.data(), count, p))
+              << impl.first << " count=" << count << " v=" << p;
+        }
+      }
+    }
+  }
+
+  TEST_F(ClientCPPTest, HistogramLayoutKindTest) {
+    typedef impl::HistogramLayout L;
+    EXPECT_EQ(L::kLinear, L(histogram_levels_linear(0, 100, 0.1)).kind());
+    EXPECT_EQ(L::kLinear, L(histogram_levels_linear(-5, 3)).kind());
+    EXPECT_EQ(L::kPowersOfTwo, L(histogram_levels_powers_of(2, 30)).kind());
+    EXPECT_EQ(L::kPowersOfTwo,
+              L(histogram_levels_powers_of(2, 30, -10)).kind());
+    EXPECT_EQ(L::kPowersOfTwo, L(histogram_levels({1, 2, 4, 8})).kind());
+    EXPECT_EQ(L::kSearch, L(histogram_levels_powers_of(10, 5)).kind());
+    EXPECT_EQ(L::kSearch, L(default_histogram_levels).kind());
+    EXPECT_EQ(L::kSearch, L(histogram_levels({1})).kind());
+  }
+
+  TEST_F(ClientCPPTest, HistogramLayoutIndexTest) {
+    // Arithmetic indexing must agree exactly with a search, including
+    // on and right next to each level.
+    std::vector<std::vector<double>> all_levels = {
+        histogram_levels_linear(0, 100, 0.1),
+        histogram_levels_linear(-5, 3),
+        histogram_levels_linear(1e6, 500, 3.3),
+        histogram_levels_powers_of(2, 30),
+        histogram_levels_powers_of(2, 30, -10),
+        histogram_levels({1, 2, 4, 8}),
+    };
+    std::mt19937 prng(42);
+    for (auto const& levels : all_levels) {
+      impl::HistogramLayout layout(levels);
+      ASSERT_NE(impl::HistogramLayout::kSearch, layout.kind());
+      std::vector<double> probes = {-kInf, kInf, std::nan(""), 0, -0.0, -1};
+      std::uniform_real_distribution<double> dis(levels.front() - 10,
+                                                 levels[levels.size() - 2] + 10);
+      for (int i = 0; i < 1000; ++i) {
+        probes.push_back(dis(prng));
+      }
+      for (double l : layout.levels()) {
+        probes.push_back(l);
+        probes.push_back(std::nextafter(l, kInf));
+        probes.push_back(std::nextafter(l, -kInf));
+      }
+      auto const& ls = layout.levels();
+      for (double p : probes) {
+        EXPECT_EQ(impl::bucket_search_scalar(ls.data(), ls.size() - 1, p),
+                  layout.bucket_index(p))
+            << "kind=" << layout.kind() << " v=" << p;
+      }
+    }
+  }
+
   TEST_F(ClientCPPTest, BadHistogramLevelsTest) {
     EXPECT_THROW(
         new Histogram<0>("test", "test", histogram_levels({3, 2, 1, 0})),
@@ -252,6 +1164,27 @@ namespace {
                  err::InvalidNameException);
   }
 
+  TEST_F(ClientCPPTest, NameValidatorsTest) {
+    static_assert(is_valid_metric_name("http_requests_total"), "");
+    static_assert(is_valid_metric_name("_1:a"), "");
+    static_assert(!is_valid_metric_name("__reserved"), "");
+    static_assert(!is_valid_metric_name("_"), "");
+    static_assert(!is_valid_metric_name("1abc"), "");
+    static_assert(!is_valid_metric_name(""), "");
+    static_assert(is_valid_label_name("__name"), "");
+    static_assert(is_valid_label_name("lee"), "");
+    static_assert(is_valid_label_name("l"), "");
+    static_assert(!is_valid_label_name("le"), "");
+    static_assert(!is_valid_label_name("quantile"), "");
+    static_assert(!is_valid_label_name("dashed-name"), "");
+    std::string with_nul("a\0b", 3);
+    EXPECT_FALSE(is_valid_metric_name(with_nul.data(), with_nul.size()));
+    EXPECT_FALSE(is_valid_label_name(with_nul.data(), with_nul.size()));
+    std::string quantiles("quantiles");
+    EXPECT_TRUE(is_valid_label_name(quantiles.data(), quantiles.size()));
+    EXPECT_FALSE(is_valid_label_name(quantiles.data(), quantiles.size() - 1));
+  }
+
   Histogram<0> histogram_elapsed_time("elapsed_time_secs", "",
                                       histogram_levels_powers_of(10, 10, -5));
   TEST_F(ClientCPPTest, IntervalAccumulatorTest) {
@@ -3,10 +3,18 @@
 #include "registry.hh"
 #include "prometheus/proto/metrics.pb.h"
 #include "mutex.hh"
+#include "sink.hh"
 
 #include <list>
 
 namespace prometheus {
+
+  void ICollector::collect(MetricSink* sink) const {
+    for (auto const& mf : collect()) {
+      impl::write_metricfamily(*mf, sink);
+    }
+  }
+
   namespace impl {
 
     CollectorRegistry global_registry;
@@ -25,13 +33,16 @@ namespace prometheus {
 
     collection_type Collector::collect() const {
       collection_type v;
+      ProtobufSink sink(&v);
+      collect(&sink);
+      return v;
+    }
+
+    void Collector::collect(MetricSink* sink) const {
       impl::shared_lock<impl::shared_timed_mutex> l(mutex_);
       for (auto const m : metrics_) {
-        auto* mf = new MetricFamily;
-        m->collect(mf);
-        v.push_back(MetricFamilyPtr(mf));
+        m->collect(sink);
       }
-      return v;
     }
 
   } /* namespace impl */
@@ -10,6 +10,8 @@
 
 namespace prometheus {
 
+  class MetricSink;
+
   namespace impl {
     class AbstractMetric;
     class CollectorRegistry;
@@ -36,6 +38,14 @@ namespace prometheus {
     // collection process and no metrics will be exposed for this
     // collection of the whole registry.
     virtual collection_type collect() const = 0;
+
+    // Writes the metrics to a sink (see MetricSink), which lets them
+    // be exposed without building MetricFamily protobufs. The same
+    // rules as above apply, and a CollectionException should be
+    // thrown before anything is written to the sink. The default
+    // implementation writes the protobufs returned by collect(), so
+    // collectors only need to override it to avoid building them.
+    virtual void collect(MetricSink* sink) const;
   };
 
   class CollectionException : public std::runtime_error {};
@@ -53,6 +63,7 @@ namespace prometheus {
 
       // See ICollector::collect.
       virtual collection_type collect() const;
+      virtual void collect(MetricSink* sink) const;
 
       // Registers a metric with this Collector. The metric
       // can't be unregistered.
@@ -0,0 +1,355 @@
+#include "double_format.hh"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace prometheus {
+  namespace impl {
+
+    namespace {
+
+      // This is an implementation of Grisu2, as described in "Printing
+      // Floating-Point Numbers Quickly and Accurately with Integers"
+      // by Florian Loitsch (PLDI 2010). Numbers are handled as diy_fp
+      // values f * 2^e, with f a 64-bit integer. The double is scaled
+      // by a cached power of ten so that its digits can be generated
+      // with integer arithmetic, while staying within the interval of
+      // numbers that parse back to it.
+
+      struct diy_fp {
+        uint64_t f;
+        int e;
+      };
+
+      diy_fp sub(diy_fp x, diy_fp y) { return diy_fp{x.f - y.f, x.e}; }
+
+      // Returns x * y, rounded to the upper 64 bits of the product.
+      diy_fp mul(diy_fp x, diy_fp y) {
+        const uint64_t u_lo = x.f & 0xFFFFFFFFu;
+        const uint64_t u_hi = x.f >> 32;
+        const uint64_t v_lo = y.f & 0xFFFFFFFFu;
+        const uint64_t v_hi = y.f >> 32;
+        const uint64_t p0 = u_lo * v_lo;
+        const uint64_t p1 = u_lo * v_hi;
+        const uint64_t p2 = u_hi * v_lo;
+        const uint64_t p3 = u_hi * v_hi;
+        uint64_t q = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+        q += uint64_t{1} << 31;
+        return diy_fp{p3 + (p2 >> 32) + (p1 >> 32) + (q >> 32),
+                      x.e + y.e + 64};
+      }
+
+      diy_fp normalize(diy_fp x) {
+        while ((x.f >> 63) == 0) {
+          x.f <<= 1;
+          x.e--;
+        }
+        return x;
+      }
+
+      // The binary exponents of the scaled values are kept in
+      // [kAlpha, kGamma], so that their integral part fits in 32 bits.
+      const int kAlpha = -60;
+      const int kGamma = -32;
+
+      struct CachedPower {
+        uint64_t f;
+        int e;
+        int k;
+      };
+
+      // 10^k for k in [-300, 324] by steps of 8, as normalized diy_fp
+      // values rounded to 64 bits.
+      const int kCachedPowersMinDecExp = -300;
+      const int kCachedPowersDecStep = 8;
+      const CachedPower kCachedPowers[] = {
+        {0xAB70FE17C79AC6CAULL, -1060, -300},
+        {0xFF77B1FCBEBCDC4FULL, -1034, -292},
+        {0xBE5691EF416BD60CULL, -1007, -284},
+        {0x8DD01FAD907FFC3CULL, -980, -276},
+        {0xD3515C2831559A83ULL, -954, -268},
+        {0x9D71AC8FADA6C9B5ULL, -927, -260},
+        {0xEA9C227723EE8BCBULL, -901, -252},
+        {0xAECC49914078536DULL, -874, -244},
+        {0x823C12795DB6CE57ULL, -847, -236},
+        {0xC21094364DFB5637ULL, -821, -228},
+        {0x9096EA6F3848984FULL, -794, -220},
+        {0xD77485CB25823AC7ULL, -768, -212},
+        {0xA086CFCD97BF97F4ULL, -741, -204},
+        {0xEF340A98172AACE5ULL, -715, -196},
+        {0xB23867FB2A35B28EULL, -688, -188},
+        {0x84C8D4DFD2C63F3BULL, -661, -180},
+        {0xC5DD44271AD3CDBAULL, -635, -172},
+        {0x936B9FCEBB25C996ULL, -608, -164},
+        {0xDBAC6C247D62A584ULL, -582, -156},
+        {0xA3AB66580D5FDAF6ULL, -555, -148},
+        {0xF3E2F893DEC3F126ULL, -529, -140},
+        {0xB5B5ADA8AAFF80B8ULL, -502, -132},
+        {0x87625F056C7C4A8BULL, -475, -124},
+        {0xC9BCFF6034C13053ULL, -449, -116},
+        {0x964E858C91BA2655ULL, -422, -108},
+        {0xDFF9772470297EBDULL, -396, -100},
+        {0xA6DFBD9FB8E5B88FULL, -369, -92},
+        {0xF8A95FCF88747D94ULL, -343, -84},
+        {0xB94470938FA89BCFULL, -316, -76},
+        {0x8A08F0F8BF0F156BULL, -289, -68},
+        {0xCDB02555653131B6ULL, -263, -60},
+        {0x993FE2C6D07B7FACULL, -236, -52},
+        {0xE45C10C42A2B3B06ULL, -210, -44},
+        {0xAA242499697392D3ULL, -183, -36},
+        {0xFD87B5F28300CA0EULL, -157, -28},
+        {0xBCE5086492111AEBULL, -130, -20},
+        {0x8CBCCC096F5088CCULL, -103, -12},
+        {0xD1B71758E219652CULL, -77, -4},
+        {0x9C40000000000000ULL, -50, 4},
+        {0xE8D4A51000000000ULL, -24, 12},
+        {0xAD78EBC5AC620000ULL, 3, 20},
+        {0x813F3978F8940984ULL, 30, 28},
+        {0xC097CE7BC90715B3ULL, 56, 36},
+        {0x8F7E32CE7BEA5C70ULL, 83, 44},
+        {0xD5D238A4ABE98068ULL, 109, 52},
+        {0x9F4F2726179A2245ULL, 136, 60},
+        {0xED63A231D4C4FB27ULL, 162, 68},
+        {0xB0DE65388CC8ADA8ULL, 189, 76},
+        {0x83C7088E1AAB65DBULL, 216, 84},
+        {0xC45D1DF942711D9AULL, 242, 92},
+        {0x924D692CA61BE758ULL, 269, 100},
+        {0xDA01EE641A708DEAULL, 295, 108},
+        {0xA26DA3999AEF774AULL, 322, 116},
+        {0xF209787BB47D6B85ULL, 348, 124},
+        {0xB454E4A179DD1877ULL, 375, 132},
+        {0x865B86925B9BC5C2ULL, 402, 140},
+        {0xC83553C5C8965D3DULL, 428, 148},
+        {0x952AB45CFA97A0B3ULL, 455, 156},
+        {0xDE469FBD99A05FE3ULL, 481, 164},
+        {0xA59BC234DB398C25ULL, 508, 172},
+        {0xF6C69A72A3989F5CULL, 534, 180},
+        {0xB7DCBF5354E9BECEULL, 561, 188},
+        {0x88FCF317F22241E2ULL, 588, 196},
+        {0xCC20CE9BD35C78A5ULL, 614, 204},
+        {0x98165AF37B2153DFULL, 641, 212},
+        {0xE2A0B5DC971F303AULL, 667, 220},
+        {0xA8D9D1535CE3B396ULL, 694, 228},
+        {0xFB9B7CD9A4A7443CULL, 720, 236},
+        {0xBB764C4CA7A44410ULL, 747, 244},
+        {0x8BAB8EEFB6409C1AULL, 774, 252},
+        {0xD01FEF10A657842CULL, 800, 260},
+        {0x9B10A4E5E9913129ULL, 827, 268},
+        {0xE7109BFBA19C0C9DULL, 853, 276},
+        {0xAC2820D9623BF429ULL, 880, 284},
+        {0x80444B5E7AA7CF85ULL, 907, 292},
+        {0xBF21E44003ACDD2DULL, 933, 300},
+        {0x8E679C2F5E44FF8FULL, 960, 308},
+        {0xD433179D9C8CB841ULL, 986, 316},
+        {0x9E19DB92B4E31BA9ULL, 1013, 324},
+      };
+
+      // Returns a cached power c such that kAlpha <= c.e + e + 64 <=
+      // kGamma.
+      CachedPower const& cached_power(int e) {
+        // k = ceil((kAlpha - e - 1) * log10(2)), with 78913 / 2^18
+        // approximating log10(2).
+        const int f = kAlpha - e - 1;
+        const int k = (f * 78913) / (1 << 18) + (f > 0);
+        const int index = (-kCachedPowersMinDecExp + k +
+                           (kCachedPowersDecStep - 1)) /
+                          kCachedPowersDecStep;
+        return kCachedPowers[index];
+      }
+
+      // Returns the number of decimal digits of n (which is less than
+      // 10^10), and sets pow10 to 10^(digits - 1).
+      int decimal_digits(uint32_t n, uint32_t* pow10) {
+        int digits = 1;
+        *pow10 = 1;
+        while (digits < 10 && n / *pow10 >= 10) {
+          *pow10 *= 10;
+          ++digits;
+        }
+        return digits;
+      }
+
+      // Moves the last digit towards w (at distance dist from the
+      // upper bound), as long as the number stays in the interval of
+      // width delta.
+      void round_digits(char* buffer, int length, uint64_t dist,
+                        uint64_t delta, uint64_t rest, uint64_t ten_k) {
+        while (rest < dist && delta - rest >= ten_k &&
+               (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+          buffer[length - 1]--;
+          rest += ten_k;
+        }
+      }
+
+      // Generates the shortest digits of a number in [m_minus, m_plus]
+      // that is closest to w, such that the number is buffer * 10^exp.
+      void generate_digits(char* buffer, int* length, int* exp,
+                           diy_fp m_minus, diy_fp w, diy_fp m_plus) {
+        uint64_t delta = sub(m_plus, m_minus).f;
+        uint64_t dist = sub(m_plus, w).f;
+        const diy_fp one{uint64_t{1} << -m_plus.e, m_plus.e};
+        uint32_t p1 = static_cast<uint32_t>(m_plus.f >> -one.e);
+        uint64_t p2 = m_plus.f & (one.f - 1);
+
+        // The integral part.
+        uint32_t pow10;
+        int n = decimal_digits(p1, &pow10);
+        while (n > 0) {
+          buffer[(*length)++] = static_cast<char>('0' + p1 / pow10);
+          p1 %= pow10;
+          --n;
+          uint64_t rest = (uint64_t{p1} << -one.e) + p2;
+          if (rest <= delta) {
+            *exp += n;
+            round_digits(buffer, *length, dist, delta, rest,
+                         uint64_t{pow10} << -one.e);
+            return;
+          }
+          pow10 /= 10;
+        }
+
+        // The fractional part.
+        int m = 0;
+        while (true) {
+          p2 *= 10;
+          buffer[(*length)++] = static_cast<char>('0' + (p2 >> -one.e));
+          p2 &= one.f - 1;
+          ++m;
+          delta *= 10;
+          dist *= 10;
+          if (p2 <= delta) {
+            break;
+          }
+        }
+        *exp -= m;
+        round_digits(buffer, *length, dist, delta, p2, one.f);
+      }
+
+      // Writes the digits of the positive, finite d to buffer, such
+      // that d is buffer * 10^exp.
+      void grisu2(double d, char* buffer, int* length, int* exp) {
+        const int kBias = 1075;
+        const uint64_t kHiddenBit = uint64_t{1} << 52;
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        const int be = static_cast<int>(bits >> 52);
+        const uint64_t bf = bits & (kHiddenBit - 1);
+        const diy_fp v = be == 0 ? diy_fp{bf, 1 - kBias}
+                                 : diy_fp{bf + kHiddenBit, be - kBias};
+
+        // The boundaries of the numbers that round to d, which are
+        // halfway to its neighbours. The lower one is closer for powers
+        // of two.
+        const diy_fp plus = normalize(diy_fp{2 * v.f + 1, v.e - 1});
+        diy_fp minus = (bf == 0 && be > 1) ? diy_fp{4 * v.f - 1, v.e - 2}
+                                           : diy_fp{2 * v.f - 1, v.e - 1};
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+
+        CachedPower const& cached = cached_power(plus.e);
+        const diy_fp c{cached.f, cached.e};
+        const diy_fp w = mul(normalize(v), c);
+        const diy_fp w_minus = mul(minus, c);
+        const diy_fp w_plus = mul(plus, c);
+        // The products are rounded, so the interval is shrunk by one
+        // unit on both sides to stay within the exact boundaries.
+        *length = 0;
+        *exp = -cached.k;
+        generate_digits(buffer, length, exp, diy_fp{w_minus.f + 1, w_minus.e},
+                        w, diy_fp{w_plus.f - 1, w_plus.e});
+      }
+
+      // Writes the decimal digits of n, and returns the end of the
+      // written characters.
+      char* write_integer(uint64_t n, char* buffer) {
+        char digits[20];
+        int i = 0;
+        do {
+          digits[i++] = static_cast<char>('0' + n % 10);
+          n /= 10;
+        } while (n != 0);
+        while (i > 0) {
+          *buffer++ = digits[--i];
+        }
+        return buffer;
+      }
+
+      // Writes digits (of which there are length) * 10^exp.
+      char* write_digits(char const* digits, int length, int exp,
+                         char* buffer) {
+        // The position of the decimal point relative to the digits, so
+        // that the decimal exponent of the number is point - 1.
+        const int point = length + exp;
+        if (length <= point && point <= 15) {
+          std::memcpy(buffer, digits, length);
+          buffer += length;
+          std::memset(buffer, '0', point - length);
+          return buffer + (point - length);
+        }
+        if (0 < point && point <= 15) {
+          std::memcpy(buffer, digits, point);
+          buffer += point;
+          *buffer++ = '.';
+          std::memcpy(buffer, digits + point, length - point);
+          return buffer + (length - point);
+        }
+        if (-3 <= point && point <= 0) {
+          *buffer++ = '0';
+          *buffer++ = '.';
+          std::memset(buffer, '0', -point);
+          buffer += -point;
+          std::memcpy(buffer, digits, length);
+          return buffer + length;
+        }
+        *buffer++ = digits[0];
+        if (length > 1) {
+          *buffer++ = '.';
+          std::memcpy(buffer, digits + 1, length - 1);
+          buffer += length - 1;
+        }
+        int e = point - 1;
+        *buffer++ = 'e';
+        *buffer++ = e < 0 ? '-' : '+';
+        if (e < 0) {
+          e = -e;
+        }
+        if (e < 10) {
+          *buffer++ = '0';
+        }
+        return write_integer(static_cast<uint64_t>(e), buffer);
+      }
+
+    } /* namespace */
+
+    char* format_double(double d, char* buffer) {
+      if (std::isnan(d)) {
+        std::memcpy(buffer, "NaN", 3);
+        return buffer + 3;
+      }
+      if (std::isinf(d)) {
+        std::memcpy(buffer, d < 0 ? "-Inf" : "+Inf", 4);
+        return buffer + 4;
+      }
+      if (std::signbit(d)) {
+        *buffer++ = '-';
+        d = -d;
+      }
+      // Counters and most gauges hold whole numbers, which are written
+      // without going through Grisu2.
+      const double kMaxInteger = 9007199254740992.0;  // 2^53
+      if (d <= kMaxInteger) {
+        uint64_t n = static_cast<uint64_t>(d);
+        if (static_cast<double>(n) == d) {
+          return write_integer(n, buffer);
+        }
+      }
+      char digits[18];
+      int length;
+      int exp;
+      grisu2(d, digits, &length, &exp);
+      return write_digits(digits, length, exp, buffer);
+    }
+
+  } /* namespace impl */
+} /* namespace prometheus */
@@ -0,0 +1,31 @@
+#ifndef PROMETHEUS_DOUBLE_FORMAT_HH__
+#define PROMETHEUS_DOUBLE_FORMAT_HH__
+
+#include <cstddef>
+
+namespace prometheus {
+  namespace impl {
+
+    // The maximum number of characters written by format_double(),
+    // e.g. "-2.2250738585072014e-308".
+    const std::size_t kMaxDoubleLength = 32;
+
+    // Writes d to buffer as the text format expects it, and returns
+    // the end of the written characters (no terminating null
+    // character is written). buffer must have room for
+    // kMaxDoubleLength characters.
+    //
+    // Infinities are written as "+Inf" and "-Inf", and NaN as
+    // "NaN". Whole numbers up to 2^53 are written as integers, other
+    // numbers with the fewest digits that parse back to d (with the
+    // Grisu2 algorithm, which finds the shortest representation for
+    // almost all doubles, and a representation that parses back to d
+    // for all of them). Like with "%g", numbers are written in fixed
+    // notation if their decimal exponent is in [-4, 15), and in
+    // scientific notation otherwise.
+    char* format_double(double d, char* buffer);
+
+  } /* namespace impl */
+} /* namespace prometheus */
+
+#endif
@@ -15,6 +15,14 @@ namespace prometheus {
       return "invalid_name";
     }
 
+    const char* InvalidQuantileException::what() const noexcept {
+      return "invalid_quantile";
+    }
+
+    const char* InvalidLabelValueException::what() const noexcept {
+      return "invalid_label_value";
+    }
+
     const char* CollectorManagementException::what() const noexcept {
       return "collector_management";
     }
@@ -24,6 +24,17 @@ namespace prometheus {
       virtual const char* what() const noexcept;
     };
 
+    class InvalidQuantileException : public std::exception {
+      // A Summary was created with a quantile outside of [0, 1].
+      virtual const char* what() const noexcept;
+    };
+
+    class InvalidLabelValueException : public std::exception {
+      // A metric with enumerated labels was given a label value
+      // outside of the domain of the label.
+      virtual const char* what() const noexcept;
+    };
+
     class CollectorManagementException : public std::exception {
       // A Collector was either added twice to a CollectorRegistry, or
       // removed without being added first.
@@ -0,0 +1,102 @@
+#include "interned_string.hh"
+
+#include <array>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+namespace prometheus {
+  namespace impl {
+
+    namespace {
+      // The pool is split in shards by the hash of the strings, so
+      // that children created concurrently rarely wait for each
+      // other.
+      struct InternPoolShard {
+        std::mutex mutex;
+        // Indexed by views on the values of the entries.
+        std::unordered_map<util::string_view, InternedString::Entry*> entries;
+      };
+      const std::size_t kInternPoolShards = 16;
+      typedef std::array<InternPoolShard, kInternPoolShards> InternPool;
+
+      // The pool is never destroyed, so that metrics destroyed at
+      // exit can still release their strings.
+      InternPool& pool() {
+        static InternPool* pool = new InternPool;
+        return *pool;
+      }
+
+      InternPoolShard& pool_shard(util::string_view s) {
+        return pool()[std::hash<util::string_view>()(s) % kInternPoolShards];
+      }
+
+      std::string const& empty_string() {
+        static const std::string* empty = new std::string;
+        return *empty;
+      }
+    } /* namespace */
+
+    InternedString::InternedString(util::string_view s) : entry_(nullptr) {
+      if (s.empty()) {
+        return;
+      }
+      InternPoolShard& p = pool_shard(s);
+      std::lock_guard<std::mutex> l(p.mutex);
+      auto it = p.entries.find(s);
+      if (it != p.entries.end()) {
+        entry_ = it->second;
+        entry_->refs.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      entry_ = new Entry(s);
+      p.entries.emplace(util::string_view(entry_->value), entry_);
+    }
+
+    InternedString::InternedString(InternedString const& rhs)
+        : entry_(rhs.entry_) {
+      // rhs holds a reference, so the entry can't be released
+      // concurrently.
+      if (entry_ != nullptr) {
+        entry_->refs.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    InternedString::~InternedString() {
+      if (entry_ == nullptr) {
+        return;
+      }
+      std::size_t refs = entry_->refs.load(std::memory_order_relaxed);
+      while (refs > 1) {
+        if (entry_->refs.compare_exchange_weak(refs, refs - 1,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+          return;
+        }
+      }
+      // The last reference is released with the pool locked, so that
+      // the entry can't be found and referenced again while it is
+      // being erased.
+      InternPoolShard& p = pool_shard(entry_->value);
+      std::lock_guard<std::mutex> l(p.mutex);
+      if (entry_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        p.entries.erase(util::string_view(entry_->value));
+        delete entry_;
+      }
+    }
+
+    std::string const& InternedString::str() const {
+      return entry_ != nullptr ? entry_->value : empty_string();
+    }
+
+    /* static */ std::size_t InternedString::pool_size() {
+      std::size_t size = 0;
+      for (InternPoolShard& p : pool()) {
+        std::lock_guard<std::mutex> l(p.mutex);
+        size += p.entries.size();
+      }
+      return size;
+    }
+
+  } /* namespace impl */
+} /* namespace prometheus */
@@ -0,0 +1,68 @@
+#ifndef PROMETHEUS_INTERNED_STRING_HH__
+#define PROMETHEUS_INTERNED_STRING_HH__
+
+#include "util/string_view.hh"
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <utility>
+
+namespace prometheus {
+  namespace impl {
+
+    class InternedString {
+      // A reference to the single copy of a string kept in a global
+      // pool. Label values are interned, so that a value used by
+      // many children (e.g. "GET" or "200") is only stored once
+      // across all metrics. Interned strings are reference counted
+      // and removed from the pool when their last reference goes
+      // away.
+      //
+      // The characters of an interned string never move, and two
+      // equal interned strings share them, so views on interned
+      // strings compare equal on their first pointer comparison.
+     public:
+      // The empty string, which isn't stored in the pool.
+      InternedString() : entry_(nullptr) {}
+      explicit InternedString(util::string_view s);
+      InternedString(InternedString const& rhs);
+      InternedString(InternedString&& rhs) noexcept : entry_(rhs.entry_) {
+        rhs.entry_ = nullptr;
+      }
+      InternedString& operator=(InternedString rhs) noexcept {
+        std::swap(entry_, rhs.entry_);
+        return *this;
+      }
+      ~InternedString();
+
+      std::string const& str() const;
+      util::string_view view() const { return util::string_view(str()); }
+
+      friend bool operator==(InternedString const& lhs,
+                             InternedString const& rhs) {
+        return lhs.entry_ == rhs.entry_;
+      }
+      friend bool operator!=(InternedString const& lhs,
+                             InternedString const& rhs) {
+        return lhs.entry_ != rhs.entry_;
+      }
+
+      // The number of distinct strings in the pool. This is useful
+      // for testing.
+      static std::size_t pool_size();
+
+      struct Entry {
+        explicit Entry(util::string_view s) : value(s.to_string()), refs(1) {}
+        const std::string value;
+        std::atomic<std::size_t> refs;
+      };
+
+     private:
+      Entry* entry_;
+    };
+
+  } /* namespace impl */
+} /* namespace prometheus */
+
+#endif /* PROMETHEUS_INTERNED_STRING_HH__ */
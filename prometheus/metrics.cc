@@ -1,9 +1,7 @@
 #include "client.hh"
 #include "exceptions.hh"
 #include "metrics.hh"
-#include "prometheus/proto/metrics.pb.h"
-
-#include <regex>
+#include "names.hh"
 
 namespace prometheus {
   namespace impl {
@@ -14,29 +12,25 @@ namespace prometheus {
                                    const std::string& help,
                                    Collector* collector)
         : name_(name), help_(help) {
-      const std::regex metric_name_re("^((_[a-zA-Z0-9:])|[a-zA-Z:])[a-zA-Z0-9_:]*$");
-      if (!std::regex_match(name_, metric_name_re)) {
+      if (!is_valid_metric_name(name_.data(), name_.size())) {
         throw err::InvalidNameException();
       }
       collector->register_metric(this);
     }
 
-    void AbstractMetric::collect_internal(MetricFamily* mf) const {
-      mf->set_name(name_);
-      mf->set_help(help_);
-    }
+    /* static */ const char AbstractMetric::kOverflowLabelValue[] =
+        "__overflow__";
 
-    /* static */ Metric* AbstractMetric::add_metric(MetricFamily* mf) {
-      return mf->add_metric();
-    }
-    /* static */ LabelPair* AbstractMetric::add_label(Metric* m) {
-      return m->add_label();
+    /* static */ void AbstractMetric::check_label_name(
+        std::string const& name) {
+      if (!is_valid_label_name(name.data(), name.size())) {
+        throw err::InvalidNameException();
+      }
     }
-    /* static */ void AbstractMetric::set_label(LabelPair* l,
-                                                std::string const& name,
-                                                std::string const& value) {
-      l->set_name(name);
-      l->set_value(value);
+
+    void AbstractMetric::collect(MetricFamily* mf) const {
+      ProtobufSink sink(mf);
+      collect(&sink);
     }
 
   } /* namespace impl */
@@ -3,25 +3,65 @@
 
 #include "collector.hh"
 #include "exceptions.hh"
+#include "interned_string.hh"
+#include "mutex.hh"
 #include "proto/stubs.hh"
+#include "sink.hh"
+#include "slab.hh"
+#include "text_escape.hh"
 #include "util/container_hash.hh"
+#include "util/label_value.hh"
+#include "util/string_view.hh"
 #include "util/zipped_iterator.hh"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
 #include <mutex>
-#include <regex>
 #include <string>
 #include <type_traits>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace prometheus {
+
+  template <typename T>
+  class EnumLabel {
+    // A label whose values form a small fixed domain, for metrics
+    // with enumerated labels (EnumCounter, etc.). T is an enum or an
+    // integer type whose values are 0, 1, ..., size() - 1, and
+    // values()[i] is the string exported for the value i.
+   public:
+    EnumLabel(std::string const& name, std::vector<std::string> const& values)
+        : name_(name), values_(values) {}
+
+    // Returns a label whose values are the integers from 0 to
+    // count - 1, e.g. for shard ids.
+    static EnumLabel range(std::string const& name, std::size_t count) {
+      std::vector<std::string> values;
+      for (std::size_t i = 0; i < count; ++i) {
+        values.push_back(std::to_string(i));
+      }
+      return EnumLabel(name, values);
+    }
+
+    std::string const& name() const { return name_; }
+    std::vector<std::string> const& values() const { return values_; }
+    std::size_t size() const { return values_.size(); }
+
+   private:
+    std::string name_;
+    std::vector<std::string> values_;
+  };
+
   namespace impl {
 
-    using ::prometheus::client::LabelPair;
     using ::prometheus::client::MetricFamily;
-    using ::prometheus::client::Metric;
 
     class Registry;
 
@@ -35,26 +75,109 @@ namespace prometheus {
       AbstractMetric(const std::string& name, const std::string& help,
                      Collector* collector);
 
-      // All metrics can be collected to a MetricFamily protobuf
-      // object.
-      virtual void collect(MetricFamily* mf) const = 0;
+      // All metrics can be collected to a MetricSink, which receives
+      // a single family.
+      virtual void collect(MetricSink* sink) const = 0;
+
+      // Collects the metric to a MetricFamily protobuf object.
+      void collect(MetricFamily* mf) const;
+
+      // The value of all labels of the child that collects the
+      // updates of label values past the limit on the number of
+      // children (see LabeledMetric::set_max_children()).
+      static const char kOverflowLabelValue[];
 
      protected:
-      // Sets the name and help text in the MetricFamily.
-      void collect_internal(MetricFamily* mf) const;
+      // Throws an InvalidNameException if name is not a valid label
+      // name, or is reserved ("le" and "quantile").
+      static void check_label_name(std::string const& name);
 
-      // These static methods wrap operations on protobuf objects so
-      // the header only needs a forward declaration of the classes.
-      static Metric* add_metric(MetricFamily* mf);
-      static LabelPair* add_label(Metric* m);
-      static void set_label(LabelPair* l, std::string const& name,
-                            std::string const& value);
+      // Starts the family of this metric in the sink.
+      void collect_family(MetricSink* sink, MetricType type) const {
+        sink->family(name_, help_, type);
+      }
+
+      // Writes a series to a sink that caches series (see
+      // MetricSink::caches_series()): the value is first collected to
+      // recorder, and if its fingerprint is the same as in the last
+      // collection the sink reuses its cached output, otherwise the
+      // series is written and cached.
+      template <class ValueType>
+      static void collect_cached_series(MetricSink* sink,
+                                        MetricSink::Label const* labels,
+                                        std::size_t count,
+                                        util::string_view text_labels,
+                                        ValueType const& value,
+                                        MetricSink::SeriesCache* cache,
+                                        ValueRecorder* recorder) {
+        recorder->clear();
+        value.collect_value(recorder);
+        uint64_t fingerprint = recorder->fingerprint();
+        if (sink->write_cached_series(cache, fingerprint)) {
+          return;
+        }
+        sink->metric(labels, count, text_labels);
+        recorder->replay(sink);
+        sink->cache_series(cache, fingerprint);
+      }
 
       std::string name_;
       std::string help_;
     };
 
-    template <int N, class ValueType>
+    template <class ValueType>
+    class ChildHandle {
+      // A counted reference to a child of a LabeledMetric, returned by
+      // LabeledMetric::handle(). Unlike the reference returned by
+      // labels(), a handle stays valid after the child is removed
+      // with remove() or clear(): the child is only destroyed when
+      // the last handle on it goes away. Once removed, the child is no
+      // longer collected, so updates made through the handle are not
+      // exported anymore, and labels() creates a new child for the
+      // same label values.
+      //
+      // Caching a handle avoids looking up the label values on each
+      // update.
+     public:
+      ChildHandle() : value_(nullptr), slot_(nullptr) {}
+      // Takes a reference on the child in slot, whose value is value.
+      ChildHandle(ValueType* value, SlabSlot* slot)
+          : value_(value), slot_(slot) {
+        slot_->acquire();
+      }
+      ChildHandle(ChildHandle const& rhs)
+          : value_(rhs.value_), slot_(rhs.slot_) {
+        if (slot_ != nullptr) {
+          slot_->acquire();
+        }
+      }
+      ChildHandle(ChildHandle&& rhs) noexcept
+          : value_(rhs.value_), slot_(rhs.slot_) {
+        rhs.value_ = nullptr;
+        rhs.slot_ = nullptr;
+      }
+      ChildHandle& operator=(ChildHandle rhs) noexcept {
+        std::swap(value_, rhs.value_);
+        std::swap(slot_, rhs.slot_);
+        return *this;
+      }
+      ~ChildHandle() {
+        if (slot_ != nullptr) {
+          slot_->release();
+        }
+      }
+
+      ValueType& operator*() const { return *value_; }
+      ValueType* operator->() const { return value_; }
+      explicit operator bool() const { return value_ != nullptr; }
+
+     private:
+      ValueType* value_;
+      SlabSlot* slot_;
+    };
+
+    template <int N, class ValueType,
+              typename clock_t = std::chrono::steady_clock>
     class LabeledMetric : public AbstractMetric {
       // A labeled metric has 1 or more labels. It contains a
       // collection of ValueType objects, indexed by the set of label
@@ -62,9 +185,111 @@ namespace prometheus {
 
       // Convenience typedefs.
       typedef std::array<std::string, N> stringarray;
-      typedef std::unordered_map<stringarray, ValueType,
-                                 util::ContainerHash<stringarray>,
-                                 util::ContainerEq<stringarray>> map;
+      typedef std::array<util::LabelValue, N> labelvaluearray;
+      typedef std::array<util::string_view, N> viewarray;
+
+      // Views on a set of label values, with their hash. The hash is
+      // computed once per call to labels(), and is then kept with
+      // the child: it picks the shard, and the maps read it back
+      // instead of hashing the label values again on rehashes.
+      struct Key {
+        explicit Key(viewarray const& views)
+            : views(views), hash(util::ContainerHash<viewarray>()(views)) {}
+        Key(viewarray const& views, std::size_t hash)
+            : views(views), hash(hash) {}
+        viewarray views;
+        std::size_t hash;
+      };
+
+      // The clock that times idle children (see set_max_idle()).
+      typedef clock_t clock;
+      typedef typename clock::duration duration;
+      typedef typename clock::time_point time_point;
+
+      // A child holds its (interned) label values and its ValueType.
+      // Children are indexed by views on their label values, so that
+      // lookups can use views on the caller's strings and only an
+      // insertion interns them. Children are stored in the slab of
+      // their shard, and reference counted, so that handles keep them
+      // alive after they are removed from the index. The slab saves
+      // the allocation of the child itself, but creating a child
+      // still allocates text_labels when it outgrows the small string
+      // buffer, and whatever the copy of the ValueType allocates
+      // (e.g. the bucket counts of a histogram).
+      struct Child {
+        Child(Key const& key, ValueType const& value,
+              stringarray const& labelnames)
+            : key(key),
+              value(value),
+              last_value(value.value()),
+              last_change(clock::now()) {
+          for (std::size_t i = 0; i < N; ++i) {
+            labelvalues[i] = InternedString(key.views[i]);
+            this->key.views[i] = labelvalues[i].view();
+            if (i > 0) {
+              text_labels.append(1, ',');
+            }
+            append_text_label(&text_labels, labelnames[i], key.views[i]);
+          }
+        }
+        std::array<InternedString, N> labelvalues;
+        // The labels rendered for the text format, once for all
+        // collections (see MetricSink::metric()).
+        std::string text_labels;
+        Key key;
+        ValueType value;
+        // The output of the last collection to a sink that caches
+        // series. Only accessed with the cache mutex of the shard
+        // locked.
+        mutable MetricSink::SeriesCache cache;
+        // The value seen by the last collection that evicted idle
+        // children, and when it last changed. Only accessed with the
+        // shard locked exclusively.
+        double last_value;
+        time_point last_change;
+      };
+      // Matches the child indexed by a key.
+      struct Matches {
+        bool operator()(Child const& child) const {
+          return util::ContainerEq<viewarray>()(child.key.views, key.views);
+        }
+        Key const& key;
+      };
+      // Children are spread over kShards shards by the high bits of
+      // the hash of their label values (the indexes use the low
+      // bits), each with its own reader-writer lock. Looking up an existing
+      // child only takes a shared lock on one shard, so it never
+      // waits for other lookups or for a collection (which also
+      // takes shared locks); only the creation or removal of a child
+      // in the same shard can block it.
+      static const int kShardBits = 4;
+      static const std::size_t kShards = std::size_t(1) << kShardBits;
+      //
+      // The index of a shard holds a reference on each of its
+      // children, which are attached in the slab (see Slab), so that
+      // collections scan the slab rather than the index.
+      struct Shard {
+        Shard() : slab(new Slab<Child>) {}
+        ~Shard() {
+          index.clear(release_child);
+          for (Child* child : evicted) {
+            Slab<Child>::slot(child)->release();
+          }
+          slab->release_slab();
+        }
+        mutable shared_timed_mutex mutex;
+        // Serializes the collections that use the caches of the
+        // children, so that concurrent collections don't write them
+        // at the same time. Never taken with mutex held.
+        mutable std::mutex cache_mutex;
+        // Mutable because collect() evicts idle children.
+        mutable SlabIndex<Child> index;
+        // Children evicted by collect() (see set_max_idle()), which
+        // keep the reference of the index until max_idle after their
+        // eviction. Only accessed with mutex locked exclusively.
+        mutable std::vector<Child*> evicted;
+        Slab<Child>* const slab;
+      };
 
      public:
       // This constructor allows specifying a custom collector. It's
@@ -89,68 +314,368 @@ namespace prometheus {
                     stringarray const& labelnames, ValueArgs const&... va)
           : AbstractMetric(name, help, &global_collector),
             default_value_(va...),
-            labelnames_(labelnames) {
+            labelnames_(labelnames),
+            overflow_key_(overflow_views()),
+            size_(0),
+            max_children_(0),
+            overflows_(0),
+            max_idle_(0) {
         static_assert(N >= 1, "A LabeledMetric should have at least 1 label.");
-        const std::regex label_name_re("^[a-zA-Z_:][a-zA-Z0-9_:]*$");
         for (auto const& l : labelnames_) {
-          if (l == "le" || l == "quantile" ||
-              !std::regex_match(l, label_name_re)) {
-            throw err::InvalidNameException();
-          }
+          check_label_name(l);
         }
       }
 
+      typedef ChildHandle<ValueType> Handle;
+
       // Returns the ValueType instance indexed by the set of label
       // values passed. The ValueType instance is created if needed.
-      ValueType& labels(stringarray const& labelvalues) {
-        std::unique_lock<std::mutex> l(mutex_);
-        return (values_.insert(typename map::value_type(
-                    labelvalues, default_value_))).first->second;
+      // Label values can be strings, string views or integers; they
+      // are only copied when the instance is created.
+      ValueType& labels(labelvaluearray const& labelvalues) {
+        return with_child(Key(views(labelvalues)),
+                          [](Child* child) -> ValueType& {
+                            return child->value;
+                          });
+      }
+
+      // Same as above, for an array of strings. This is a template so
+      // that braced lists of strings prefer the overload above.
+      template <typename S = stringarray,
+                typename = typename std::enable_if<
+                    std::is_same<S, stringarray>::value>::type>
+      ValueType& labels(S const& labelvalues) {
+        return labels(to_labelvalues(labelvalues));
+      }
+
+      // Returns a handle on the ValueType instance indexed by the set
+      // of label values passed, creating the instance if needed. The
+      // handle remains valid after the instance is removed (see
+      // ChildHandle).
+      Handle handle(labelvaluearray const& labelvalues) {
+        return Handle(with_child(
+            Key(views(labelvalues)), [](Child* child) {
+              return Handle(&child->value, Slab<Child>::slot(child));
+            }));
+      }
+
+      template <typename S = stringarray,
+                typename = typename std::enable_if<
+                    std::is_same<S, stringarray>::value>::type>
+      Handle handle(S const& labelvalues) {
+        return handle(to_labelvalues(labelvalues));
       }
 
       // Removes a given set of label values and the instance of
       // ValueType it references. No-op if this set of label values
       // did not reference a ValueType instance yet. This invalidates
       // any previously returned ValueType reference to the ValueType
-      // instance referred to by this set of labelvalues.
-      void remove(stringarray const& labelvalues) {
-	std::unique_lock<std::mutex> l(mutex_);
-	values_.erase(labelvalues);
+      // instance referred to by this set of labelvalues, but not the
+      // handles on it.
+      void remove(labelvaluearray const& labelvalues) {
+        Key key(views(labelvalues));
+        Shard& shard = shard_for(key);
+        std::unique_lock<shared_timed_mutex> l(shard.mutex);
+        Child* child = shard.index.find(key.hash, Matches{key});
+        if (child != nullptr) {
+          shard.index.erase(key.hash, child);
+          release_child(child);
+          size_.fetch_sub(1, std::memory_order_relaxed);
+        }
+      }
+
+      template <typename S = stringarray,
+                typename = typename std::enable_if<
+                    std::is_same<S, stringarray>::value>::type>
+      void remove(S const& labelvalues) {
+        remove(to_labelvalues(labelvalues));
       }
 
       // Removes all sets of label values and their corresponding
       // instance of ValueType. This invalidates any previously
-      // returned ValueType reference.
+      // returned ValueType reference, but not the handles.
       void clear() {
-	std::unique_lock<std::mutex> l(mutex_);
-	values_.clear();
-      }
-
-      // Collects all values in this metric to a protobuf
-      // MetricFamily.
-      virtual void collect(MetricFamily* mf) const {
-        collect_internal(mf);
-        ValueType::set_metricfamily_type(mf);
-        std::unique_lock<std::mutex> l(mutex_);
-        for (const auto& it_v : values_) {
-          Metric* m = add_metric(mf);
-          auto it_labelname = labelnames_.begin();
-          auto it_labelvalue = it_v.first.begin();
-          while (it_labelname != labelnames_.end()) {
-            LabelPair* l = add_label(m);
-            set_label(l, *it_labelname, *it_labelvalue);
-            ++it_labelname;
-            ++it_labelvalue;
+        for (Shard& shard : shards_) {
+          std::unique_lock<shared_timed_mutex> l(shard.mutex);
+          size_.fetch_sub(shard.index.size(), std::memory_order_relaxed);
+          shard.index.clear(release_child);
+        }
+      }
+
+      // Limits the number of children to max_children (0, the
+      // default, means no limit). Once the limit is reached, label
+      // values that don't have a child yet are all mapped to a single
+      // overflow child, whose label values are all
+      // kOverflowLabelValue, and overflow_count() is incremented.
+      // Existing children are still updated as usual. The overflow
+      // child is created past the limit, but then counts in it.
+      void set_max_children(std::size_t max_children) {
+        max_children_.store(max_children, std::memory_order_relaxed);
+      }
+
+      // The number of lookups of new label values that were mapped to
+      // the overflow child because of the limit above.
+      uint64_t overflow_count() const {
+        return overflows_.load(std::memory_order_relaxed);
+      }
+
+      // The number of children, including the overflow child.
+      std::size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+      // Makes collect() remove the children that weren't updated
+      // during at least max_idle (0, the default, disables this), as
+      // if remove() was called on them. Updates aren't timestamped,
+      // as that would slow down labels(): instead, each collection
+      // compares the value() of each child with the one seen by the
+      // previous collection. A change is thus noticed up to one
+      // collection late, and updates that leave value() unchanged
+      // (e.g. setting a gauge to its current value) don't count.
+      //
+      // Children with handles on them are never evicted. An evicted
+      // child is only destroyed by the first collection at least
+      // max_idle after its eviction, so a reference returned by
+      // labels() stays valid for at least max_idle: it must not be
+      // kept longer (use handle() instead).
+      void set_max_idle(duration max_idle) {
+        max_idle_.store(max_idle.count(), std::memory_order_relaxed);
+      }
+
+      using AbstractMetric::collect;
+
+      // Collects all values in this metric to a sink. A reference is
+      // first taken on each child, one shard at a time under a shared
+      // lock (preceded by an exclusive lock to evict idle children,
+      // if enabled), by scanning their slab. The children are written
+      // after the locks are released, so that writing them never
+      // blocks the creation or removal of children. If the sink
+      // caches series, only the children whose values changed are
+      // written again.
+      virtual void collect(MetricSink* sink) const {
+        collect_family(sink, ValueType::metric_type());
+        duration max_idle(max_idle_.load(std::memory_order_relaxed));
+        time_point now;
+        if (max_idle > duration::zero()) {
+          now = clock::now();
+        }
+        const bool caching = sink->caches_series();
+        ValueRecorder recorder;
+        Snapshot snapshot;
+        for (Shard const& shard : shards_) {
+          if (max_idle > duration::zero()) {
+            evict_idle(shard, now, max_idle);
+          }
+          snapshot.take(shard);
+        }
+        std::array<MetricSink::Label, N> labels;
+        std::size_t begin = 0;
+        for (std::size_t s = 0; s < kShards; ++s) {
+          std::unique_lock<std::mutex> cl(shards_[s].cache_mutex,
+                                          std::defer_lock);
+          if (caching) {
+            cl.lock();
           }
-          it_v.second.collect_value(m);
+          std::size_t end = snapshot.shard_end(s);
+          for (std::size_t c = begin; c < end; ++c) {
+            Child const* child = snapshot.children()[c];
+            for (std::size_t i = 0; i < N; ++i) {
+              labels[i] = {labelnames_[i], child->labelvalues[i].view()};
+            }
+            if (caching) {
+              collect_cached_series(sink, labels.data(), N,
+                                    child->text_labels, child->value,
+                                    &child->cache, &recorder);
+            } else {
+              sink->metric(labels.data(), N, child->text_labels);
+              child->value.collect_value(sink);
+            }
+          }
+          begin = end;
         }
       }
 
      private:
+      // Calls f with the child indexed by key, which is created if
+      // needed (or replaced with the overflow child, see
+      // set_max_children()), and returns its result. f runs with a
+      // lock held on the shard of the child.
+      template <typename F>
+      auto with_child(Key const& key, F f, bool limited = true)
+          -> decltype(f(std::declval<Child*>())) {
+        Shard& shard = shard_for(key);
+        {
+          shared_lock<shared_timed_mutex> l(shard.mutex);
+          Child* child = shard.index.find(key.hash, Matches{key});
+          if (child != nullptr) {
+            return f(child);
+          }
+        }
+        // Don't wait for the exclusive lock if the limit is already
+        // reached.
+        if (limited && full()) {
+          return with_overflow_child(f);
+        }
+        std::unique_lock<shared_timed_mutex> l(shard.mutex);
+        // Another thread may have created the child since we released
+        // the shared lock.
+        Child* child = shard.index.find(key.hash, Matches{key});
+        if (child == nullptr) {
+          if (limited && !reserve_child()) {
+            l.unlock();
+            return with_overflow_child(f);
+          }
+          if (!limited) {
+            size_.fetch_add(1, std::memory_order_relaxed);
+          }
+          child = shard.slab->create(key, default_value_, labelnames_);
+          shard.index.insert(key.hash, child);
+          Slab<Child>::attach(child);
+        }
+        return f(child);
+      }
+
+      template <typename F>
+      auto with_overflow_child(F f)
+          -> decltype(f(std::declval<Child*>())) {
+        overflows_.fetch_add(1, std::memory_order_relaxed);
+        return with_child(overflow_key_, f, false);
+      }
+
+      bool full() const {
+        std::size_t max = max_children_.load(std::memory_order_relaxed);
+        return max != 0 && size_.load(std::memory_order_relaxed) >= max;
+      }
+
+      // Counts a new child, unless this would exceed the limit.
+      bool reserve_child() {
+        std::size_t max = max_children_.load(std::memory_order_relaxed);
+        std::size_t size = size_.fetch_add(1, std::memory_order_relaxed);
+        if (max != 0 && size >= max) {
+          size_.fetch_sub(1, std::memory_order_relaxed);
+          return false;
+        }
+        return true;
+      }
+
+      // Removes the children of a shard whose value didn't change
+      // during at least max_idle, as seen by successive collections,
+      // unless they have handles on them, and destroys the children
+      // evicted at least max_idle ago.
+      void evict_idle(Shard const& shard, time_point now,
+                      duration max_idle) const {
+        std::unique_lock<shared_timed_mutex> l(shard.mutex);
+        std::vector<Child*>& evicted = shard.evicted;
+        for (std::size_t i = 0; i < evicted.size();) {
+          if (now - evicted[i]->last_change >= max_idle) {
+            Slab<Child>::slot(evicted[i])->release();
+            evicted[i] = evicted.back();
+            evicted.pop_back();
+          } else {
+            ++i;
+          }
+        }
+        shard.slab->for_each_attached([&](Child& child) {
+          double value = child.value.value();
+          // NaN values (of gauges) are equal to each other here.
+          if (value != child.last_value &&
+              (value == value || child.last_value == child.last_value)) {
+            child.last_value = value;
+            child.last_change = now;
+          } else if (now - child.last_change >= max_idle &&
+                     Slab<Child>::slot(&child)->refs.load(
+                         std::memory_order_relaxed) == 1) {
+            // Only the index holds a reference. It is kept, so that
+            // the child survives the labels() calls that found it
+            // before its eviction.
+            shard.index.erase(child.key.hash, &child);
+            Slab<Child>::detach(&child);
+            child.last_change = now;
+            evicted.push_back(&child);
+            size_.fetch_sub(1, std::memory_order_relaxed);
+          }
+        });
+      }
+
+      class Snapshot {
+        // References on the children of the shards, which keep them
+        // alive while collect() writes them without holding the locks
+        // of the shards, even if they are removed in the meantime.
+        // Releasing the references (on destruction) destroys the
+        // children that were removed.
+       public:
+        Snapshot() : shards_(0) {}
+        Snapshot(Snapshot const&) = delete;
+        Snapshot& operator=(Snapshot const&) = delete;
+        ~Snapshot() {
+          for (Child* child : children_) {
+            Slab<Child>::slot(child)->release();
+          }
+        }
+
+        // Takes a reference on each child of the next shard, in memory
+        // order.
+        void take(Shard const& shard) {
+          shared_lock<shared_timed_mutex> l(shard.mutex);
+          shard.slab->for_each_attached([this](Child& child) {
+            Slab<Child>::slot(&child)->acquire();
+            children_.push_back(&child);
+          });
+          ends_[shards_++] = children_.size();
+        }
+
+        // The children of shard i are in [shard_end(i - 1),
+        // shard_end(i)).
+        std::vector<Child*> const& children() const { return children_; }
+        std::size_t shard_end(std::size_t i) const { return ends_[i]; }
+
+       private:
+        std::vector<Child*> children_;
+        std::array<std::size_t, kShards> ends_;
+        std::size_t shards_;
+      };
+
+      // Releases the reference of the index on a child.
+      static void release_child(Child* child) {
+        Slab<Child>::detach(child);
+        Slab<Child>::slot(child)->release();
+      }
+
+      Shard& shard_for(Key const& key) {
+        return shards_[key.hash >>
+                       (std::numeric_limits<std::size_t>::digits - kShardBits)];
+      }
+
+      static viewarray overflow_views() {
+        viewarray views;
+        views.fill(util::string_view(kOverflowLabelValue));
+        return views;
+      }
+
+      static viewarray views(labelvaluearray const& labelvalues) {
+        viewarray key;
+        for (std::size_t i = 0; i < N; ++i) {
+          key[i] = labelvalues[i].view();
+        }
+        return key;
+      }
+
+      template <std::size_t... I>
+      static labelvaluearray to_labelvalues(stringarray const& labelvalues,
+                                            std::index_sequence<I...>) {
+        return {{labelvalues[I]...}};
+      }
+      static labelvaluearray to_labelvalues(stringarray const& labelvalues) {
+        return to_labelvalues(labelvalues, std::make_index_sequence<N>());
+      }
+
       ValueType default_value_;
       stringarray const labelnames_;
-      mutable std::mutex mutex_;
-      map values_;
+      std::array<Shard, kShards> shards_;
+      const Key overflow_key_;
+      // Mutable because collect() evicts idle children.
+      mutable std::atomic<std::size_t> size_;
+      std::atomic<std::size_t> max_children_;
+      std::atomic<uint64_t> overflows_;
+      std::atomic<typename clock::rep> max_idle_;
     };
 
     template <class ValueType>
@@ -177,14 +702,135 @@ namespace prometheus {
           : AbstractMetric(name, help, &global_collector),
             ValueType(va...) {}
 
-      // Collects the metric and its value to a MetricFamily protobuf.
-      virtual void collect(MetricFamily* mf) const {
-        collect_internal(mf);
-        ValueType::set_metricfamily_type(mf);
-        this->collect_value(add_metric(mf));
+      using AbstractMetric::collect;
+
+      // Collects the metric and its value to a sink.
+      virtual void collect(MetricSink* sink) const {
+        collect_family(sink, ValueType::metric_type());
+        sink->metric(nullptr, 0, util::string_view());
+        this->collect_value(sink);
       }
     };
 
+    template <class ValueType, typename... Labels>
+    class EnumLabeledMetric : public AbstractMetric {
+      // A labeled metric whose labels all have a small fixed domain
+      // (see EnumLabel). Every combination of label values has a
+      // ValueType instance, allocated at construction in a dense
+      // array, so labels() only computes an index: it doesn't hash,
+      // lock or allocate. The instances are never removed, and all of
+      // them are collected, including those that were never updated.
+      static const std::size_t N = sizeof...(Labels);
+
+     public:
+      // An EnumLabeledMetric is constructed with a name, help text,
+      // one EnumLabel per label, and any arguments required by the
+      // ValueType.
+      template <typename... ValueArgs>
+      EnumLabeledMetric(std::string const& name, std::string const& help,
+                        EnumLabel<Labels> const&... labels,
+                        ValueArgs const&... va)
+          : AbstractMetric(name, help, &global_collector),
+            labelnames_{{labels.name()...}},
+            labelvalues_{{labels.values()...}},
+            values_(product({labels.size()...}), ValueType(va...)) {
+        static_assert(N >= 1,
+                      "An EnumLabeledMetric should have at least 1 label.");
+        std::size_t stride = 1;
+        for (std::size_t i = N; i-- > 0;) {
+          check_label_name(labelnames_[i]);
+          strides_[i] = stride;
+          stride *= labelvalues_[i].size();
+        }
+        text_labels_.resize(values_.size());
+        for (std::size_t index = 0; index < values_.size(); ++index) {
+          for (std::size_t i = 0; i < N; ++i) {
+            if (i > 0) {
+              text_labels_[index].append(1, ',');
+            }
+            append_text_label(&text_labels_[index], labelnames_[i],
+                              labelvalues_[i][label_value(index, i)]);
+          }
+        }
+      }
+
+      // Returns the ValueType instance for the given label values.
+      // Throws an InvalidLabelValueException if a value is outside of
+      // the domain of its label.
+      ValueType& labels(Labels... values) {
+        const std::size_t indexes[] = {static_cast<std::size_t>(values)...};
+        std::size_t index = 0;
+        for (std::size_t i = 0; i < N; ++i) {
+          if (indexes[i] >= labelvalues_[i].size()) {
+            throw err::InvalidLabelValueException();
+          }
+          index += indexes[i] * strides_[i];
+        }
+        return values_[index];
+      }
+
+      using AbstractMetric::collect;
+
+      // Collects all values in this metric to a sink. If the sink
+      // caches series, only the values that changed are written
+      // again.
+      virtual void collect(MetricSink* sink) const {
+        collect_family(sink, ValueType::metric_type());
+        std::array<MetricSink::Label, N> labels;
+        if (sink->caches_series()) {
+          std::lock_guard<std::mutex> l(cache_mutex_);
+          caches_.resize(values_.size());
+          ValueRecorder recorder;
+          for (std::size_t index = 0; index < values_.size(); ++index) {
+            for (std::size_t i = 0; i < N; ++i) {
+              labels[i] = {labelnames_[i],
+                           labelvalues_[i][label_value(index, i)]};
+            }
+            collect_cached_series(sink, labels.data(), N,
+                                  text_labels_[index], values_[index],
+                                  &caches_[index], &recorder);
+          }
+          return;
+        }
+        for (std::size_t index = 0; index < values_.size(); ++index) {
+          for (std::size_t i = 0; i < N; ++i) {
+            labels[i] = {labelnames_[i],
+                         labelvalues_[i][label_value(index, i)]};
+          }
+          sink->metric(labels.data(), N, text_labels_[index]);
+          values_[index].collect_value(sink);
+        }
+      }
+
+     private:
+      // Returns the index of the value of label i in the combination
+      // of label values at index.
+      std::size_t label_value(std::size_t index, std::size_t i) const {
+        return index / strides_[i] % labelvalues_[i].size();
+      }
+
+      static std::size_t product(std::initializer_list<std::size_t> sizes) {
+        std::size_t p = 1;
+        for (std::size_t size : sizes) {
+          p *= size;
+        }
+        return p;
+      }
+
+      std::array<std::string, N> const labelnames_;
+      std::array<std::vector<std::string>, N> const labelvalues_;
+      // The index of a combination of label values is the sum of
+      // each value times the stride of its label.
+      std::array<std::size_t, N> strides_;
+      std::vector<ValueType> values_;
+      // The labels of each combination, rendered for the text format.
+      std::vector<std::string> text_labels_;
+      // The output of each combination in the last collection to a
+      // sink that caches series, allocated by the first one.
+      mutable std::mutex cache_mutex_;
+      mutable std::vector<MetricSink::SeriesCache> caches_;
+    };
+
   } /* namespace impl */
 } /* namespace prometheus */
 
@@ -0,0 +1,85 @@
+#ifndef PROMETHEUS_NAMES_HH__
+#define PROMETHEUS_NAMES_HH__
+
+#include <cstddef>
+
+namespace prometheus {
+
+  // Validators for metric and label names, following the data model
+  // of Prometheus. They are constexpr, so that names given as string
+  // literals can be checked at compile time, e.g.:
+  //
+  //   static_assert(prometheus::is_valid_metric_name("http_requests"),
+  //                 "invalid metric name");
+  //
+  // Metrics check their names with the same functions when they are
+  // constructed, with a single scan of the bytes of the names.
+
+  namespace impl {
+    constexpr bool is_name_start_char(char c) {
+      return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == ':' ||
+             c == '_';
+    }
+    constexpr bool is_name_char(char c) {
+      return is_name_start_char(c) || ('0' <= c && c <= '9');
+    }
+    constexpr bool equals(const char* name, std::size_t size,
+                          const char* literal) {
+      std::size_t i = 0;
+      for (; i < size; ++i) {
+        if (literal[i] == '\0' || literal[i] != name[i]) {
+          return false;
+        }
+      }
+      return literal[i] == '\0';
+    }
+  } /* namespace impl */
+
+  // A metric name matches [a-zA-Z_:][a-zA-Z0-9_:]*, and doesn't start
+  // with "__", which is reserved for internal use. A single "_" is
+  // invalid too.
+  constexpr bool is_valid_metric_name(const char* name, std::size_t size) {
+    if (size == 0 || !impl::is_name_start_char(name[0])) {
+      return false;
+    }
+    if (name[0] == '_' && (size == 1 || name[1] == '_')) {
+      return false;
+    }
+    for (std::size_t i = 1; i < size; ++i) {
+      if (!impl::is_name_char(name[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // A label name matches [a-zA-Z_:][a-zA-Z0-9_:]*, and isn't one of
+  // the names used by histograms and summaries ("le" and
+  // "quantile").
+  constexpr bool is_valid_label_name(const char* name, std::size_t size) {
+    if (size == 0 || !impl::is_name_start_char(name[0]) ||
+        impl::equals(name, size, "le") ||
+        impl::equals(name, size, "quantile")) {
+      return false;
+    }
+    for (std::size_t i = 1; i < size; ++i) {
+      if (!impl::is_name_char(name[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Same as above, for string literals.
+  template <std::size_t M>
+  constexpr bool is_valid_metric_name(const char (&name)[M]) {
+    return is_valid_metric_name(name, M - 1);
+  }
+  template <std::size_t M>
+  constexpr bool is_valid_label_name(const char (&name)[M]) {
+    return is_valid_label_name(name, M - 1);
+  }
+
+} /* namespace prometheus */
+
+#endif /* PROMETHEUS_NAMES_HH__ */
@@ -1,12 +1,12 @@
 #include "prometheus/proto/metrics.pb.h"
+#include "double_format.hh"
 #include "output_formatter.hh"
+#include "text_escape.hh"
 
-#include <cmath>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 
-#include <unicode/unistr.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
 
@@ -16,7 +16,8 @@ namespace prometheus {
   using ::prometheus::client::Histogram;
   using ::prometheus::client::LabelPair;
   using ::prometheus::client::Metric;
-  using ::prometheus::client::MetricType;
+  using ::prometheus::client::Quantile;
+  using ::prometheus::client::Summary;
 
   std::string
   render(collection_type const& collection, exposition_format format) {
@@ -88,17 +89,17 @@ namespace prometheus {
     protobuf_delimited(collection, stream);
   }
 
-  static std::string escape_type(MetricType const& t) {
+  static std::string escape_type(client::MetricType const& t) {
     switch (t) {
-    case MetricType::COUNTER:
+    case client::MetricType::COUNTER:
       return "counter";
-    case MetricType::GAUGE:
+    case client::MetricType::GAUGE:
       return "gauge";
-    case MetricType::SUMMARY:
+    case client::MetricType::SUMMARY:
       return "summary";
-    case MetricType::HISTOGRAM:
+    case client::MetricType::HISTOGRAM:
       return "histogram";
-    case MetricType::UNTYPED:
+    case client::MetricType::UNTYPED:
       return "untyped";
     default:
       throw impl::OutputFormatterException(
@@ -150,8 +151,29 @@ namespace prometheus {
 
   void summary_proto_to_ostream(std::string const& escaped_name,
 				Metric const& m, std::ostream& ss) {
-    throw impl::OutputFormatterException(
-      impl::OutputFormatterException::kSummariesNotImplemented);
+    if (!m.has_summary() || !m.summary().has_sample_count()) {
+      throw impl::OutputFormatterException(
+	impl::OutputFormatterException::kMissingRequiredField);
+    }
+    Summary const& s = m.summary();
+    for (int i = 0; i < s.quantile_size(); ++i) {
+      Quantile const& q = s.quantile(i);
+      if (!q.has_quantile() || !q.has_value()) {
+	throw impl::OutputFormatterException(
+	  impl::OutputFormatterException::kMissingRequiredField);
+      }
+      ss << escaped_name << '{';
+      metric_labels_proto_to_ostream(m, ss);
+      if (m.label_size() > 0) {
+	ss << ',';
+      }
+      ss << "quantile=\"" << escape_double(q.quantile())
+	 << "\"} " << escape_double(q.value()) << std::endl;
+    }
+    metric_proto_to_ostream_common(escaped_name + "_sum", m, ss);
+    ss << escape_double(s.sample_sum()) << std::endl;
+    metric_proto_to_ostream_common(escaped_name + "_count", m, ss);
+    ss << s.sample_count() << std::endl;
   }
 
   void histogram_proto_to_ostream(std::string const& escaped_name,
@@ -201,19 +223,19 @@ namespace prometheus {
 	impl::OutputFormatterException::kMissingRequiredField);
     }
     switch (mf.type()) {
-    case MetricType::COUNTER:
+    case client::MetricType::COUNTER:
       counter_proto_to_ostream(escaped_name, m, ss);
       return;
-    case MetricType::GAUGE:
+    case client::MetricType::GAUGE:
       gauge_proto_to_ostream(escaped_name, m, ss);
       return;
-    case MetricType::SUMMARY:
+    case client::MetricType::SUMMARY:
       summary_proto_to_ostream(escaped_name, m, ss);
       return;
-    case MetricType::HISTOGRAM:
+    case client::MetricType::HISTOGRAM:
       histogram_proto_to_ostream(escaped_name, m, ss);
       return;
-    case MetricType::UNTYPED:
+    case client::MetricType::UNTYPED:
       untyped_proto_to_ostream(escaped_name, m, ss);
       return;
     default:
@@ -246,6 +268,137 @@ namespace prometheus {
     }
   }
 
+  static const char* type_name(MetricType type) {
+    switch (type) {
+    case MetricType::kCounter:
+      return "counter";
+    case MetricType::kGauge:
+      return "gauge";
+    case MetricType::kSummary:
+      return "summary";
+    case MetricType::kHistogram:
+      return "histogram";
+    case MetricType::kUntyped:
+      break;
+    }
+    return "untyped";
+  }
+
+  const char TextSink::kFormat = 0;
+
+  TextSink::TextSink(std::string* out, bool cache_series)
+      : out_(out),
+        cache_series_(cache_series),
+        extra_label_index_(0),
+        series_start_(0) {}
+
+  void TextSink::family(std::string const& name, std::string const& help,
+                        MetricType type) {
+    name_ = escape_metric_name(name);
+    extra_labels_.clear();
+    out_->append("# HELP ").append(name_).append(1, ' ');
+    append_escaped_help(out_, help);
+    out_->append(1, '\n');
+    out_->append("# TYPE ").append(name_).append(1, ' ')
+      .append(type_name(type)).append(1, '\n');
+  }
+
+  void TextSink::metric(Label const* labels, std::size_t count,
+                        util::string_view text_labels) {
+    extra_label_index_ = 0;
+    if (count == 0 || !text_labels.empty()) {
+      labels_ = text_labels;
+      return;
+    }
+    labels_buffer_.clear();
+    for (std::size_t i = 0; i < count; ++i) {
+      if (i > 0) {
+        labels_buffer_.append(1, ',');
+      }
+      append_text_label(&labels_buffer_, labels[i].name, labels[i].value);
+    }
+    labels_ = labels_buffer_;
+  }
+
+  // Appends d to out, as escape_double() formats it.
+  static void append_double(std::string* out, double d) {
+    char buffer[impl::kMaxDoubleLength];
+    out->append(buffer, impl::format_double(d, buffer) - buffer);
+  }
+
+  util::string_view TextSink::extra_label(const char* name, double value) {
+    if (extra_label_index_ == extra_labels_.size()) {
+      extra_labels_.emplace_back();
+    }
+    ExtraLabel& label = extra_labels_[extra_label_index_++];
+    if (label.text.empty() || label.value != value) {
+      label.value = value;
+      label.text.assign(name).append("=\"");
+      append_double(&label.text, value);
+      label.text.append(1, '"');
+    }
+    return label.text;
+  }
+
+  void TextSink::append_name(const char* suffix,
+                             util::string_view extra_label) {
+    out_->append(name_).append(suffix);
+    if (!labels_.empty() || !extra_label.empty()) {
+      out_->append(1, '{').append(labels_.data(), labels_.size());
+      if (!labels_.empty() && !extra_label.empty()) {
+        out_->append(1, ',');
+      }
+      out_->append(extra_label.data(), extra_label.size()).append(1, '}');
+    }
+    out_->append(1, ' ');
+  }
+
+  void TextSink::value(double value) {
+    append_name("", util::string_view());
+    append_double(out_, value);
+    out_->append(1, '\n');
+  }
+
+  void TextSink::bucket(double upper_bound, uint64_t cumulative_count) {
+    append_name("", extra_label("le", upper_bound));
+    out_->append(std::to_string(cumulative_count)).append(1, '\n');
+  }
+
+  void TextSink::histogram(uint64_t /*count*/, double /*sum*/) {
+    // Like metricfamily_proto_to_ostream(), only the buckets of
+    // histograms are written.
+  }
+
+  void TextSink::quantile(double quantile, double value) {
+    append_name("", extra_label("quantile", quantile));
+    append_double(out_, value);
+    out_->append(1, '\n');
+  }
+
+  void TextSink::summary(uint64_t count, double sum) {
+    append_name("_sum", util::string_view());
+    append_double(out_, sum);
+    out_->append(1, '\n');
+    append_name("_count", util::string_view());
+    out_->append(std::to_string(count)).append(1, '\n');
+  }
+
+  bool TextSink::write_cached_series(SeriesCache const* cache,
+                                     uint64_t fingerprint) {
+    if (cache->format == &kFormat && cache->fingerprint == fingerprint) {
+      out_->append(cache->output);
+      return true;
+    }
+    series_start_ = out_->size();
+    return false;
+  }
+
+  void TextSink::cache_series(SeriesCache* cache, uint64_t fingerprint) {
+    cache->format = &kFormat;
+    cache->fingerprint = fingerprint;
+    cache->output.assign(*out_, series_start_, std::string::npos);
+  }
+
   std::string escape_metric_name(std::string const& s) {
     // Assume metric names don't need escaping as they are
     // restricted to only a few characters.
@@ -253,11 +406,10 @@ namespace prometheus {
   }
 
   std::string escape_help(std::string const& s) {
-    icu::UnicodeString us = icu::UnicodeString::fromUTF8(s);
-    us.findAndReplace("\\", "\\\\").findAndReplace("\n", "\\n");
-    std::string replaced_s;
-    us.toUTF8String(replaced_s);
-    return replaced_s;
+    std::string escaped;
+    escaped.reserve(s.size());
+    append_escaped_help(&escaped, s);
+    return escaped;
   }
 
   std::string escape_label_name(std::string const& s) {
@@ -267,23 +419,15 @@ namespace prometheus {
   }
 
   std::string escape_label_value(std::string const& s) {
-    icu::UnicodeString us = icu::UnicodeString::fromUTF8(s);
-    us.findAndReplace("\\", "\\\\")
-      .findAndReplace("\"", "\\\"")
-      .findAndReplace("\n", "\\n");
-    std::string replaced_s;
-    us.toUTF8String(replaced_s);
-    return std::string("\"") + replaced_s + "\"";
+    std::string escaped;
+    escaped.reserve(s.size() + 2);
+    append_escaped_label_value(&escaped, s);
+    return escaped;
   }
 
   std::string escape_double(double d) {
-    if (std::isinf(d)) {
-      if (d < 0) return "-Inf";
-      return "+Inf";
-    }
-    char buf[256];
-    std::snprintf(buf, 256, "%g", d);
-    return std::string(buf);
+    char buffer[impl::kMaxDoubleLength];
+    return std::string(buffer, impl::format_double(d, buffer));
   }
 
   namespace impl {
@@ -292,8 +436,6 @@ namespace prometheus {
       "Invalid metric type.";
     const char* const OutputFormatterException::kMissingRequiredField =
       "Missing required field.";
-    const char* const OutputFormatterException::kSummariesNotImplemented =
-      "Summaries are not implemented.";
 
   } /* namespace impl */
 } /* namespace prometheus */
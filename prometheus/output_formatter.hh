@@ -2,8 +2,11 @@
 #define PROMETHEUS_OUTPUT_FORMATTER_HH__
 
 #include <string>
+#include <vector>
 
 #include "family.hh"
+#include "sink.hh"
+#include "text_escape.hh"
 #include "prometheus/proto/metrics.pb.h"
 
 namespace prometheus {
@@ -39,7 +42,84 @@ namespace prometheus {
   void metricfamily_proto_to_ostream(std::ostream& os, MetricFamilyPtr mf);
   std::string metricfamily_proto_to_string(MetricFamilyPtr mf);
 
-  // Escaping functions for each element of the text format.
+  class TextSink : public MetricSink {
+    // A sink that writes metrics in the text exposition format, with
+    // the same output as metricfamily_proto_to_ostream(), without
+    // building protobufs or going through a std::ostream. Metrics are
+    // appended to a string, which can be reused across collections
+    // to avoid growing a new buffer each time, e.g.:
+    //
+    //   std::string buffer;
+    //   ...
+    //   buffer.clear();
+    //   TextSink sink(&buffer);
+    //   global_registry.collect(&sink);
+   public:
+    // If cache_series is true, the output of each series is cached by
+    // the metrics that keep a SeriesCache (LabeledMetric and
+    // EnumLabeledMetric), so that only the series whose values
+    // changed since the last collection are formatted again. This
+    // makes scrapes where few series changed several times faster,
+    // but scrapes where most of them changed slower (each series is
+    // fingerprinted and copied to its cache), and the caches keep a
+    // copy of the output of every series. The values of a series are
+    // identified by a 64-bit fingerprint, so with a negligible
+    // probability a changed series could be written with its
+    // previous values, until it changes again.
+    explicit TextSink(std::string* out, bool cache_series = false);
+
+    virtual void family(std::string const& name, std::string const& help,
+                        MetricType type);
+    virtual void metric(Label const* labels, std::size_t count,
+                        util::string_view text_labels);
+    virtual void value(double value);
+    virtual void bucket(double upper_bound, uint64_t cumulative_count);
+    virtual void histogram(uint64_t count, double sum);
+    virtual void quantile(double quantile, double value);
+    virtual void summary(uint64_t count, double sum);
+
+    virtual bool caches_series() const { return cache_series_; }
+    virtual bool write_cached_series(SeriesCache const* cache,
+                                     uint64_t fingerprint);
+    virtual void cache_series(SeriesCache* cache, uint64_t fingerprint);
+
+   private:
+    // The format of the series cached by a TextSink.
+    static const char kFormat;
+
+    // Returns the rendering of the label of a bucket or quantile
+    // (e.g. le="0.5"). The metrics of a family usually have the same
+    // buckets or quantiles, so the labels are cached by position in
+    // the metric, and only rendered again if the value differs.
+    util::string_view extra_label(const char* name, double value);
+    // Appends the escaped name of the family with a suffix, and the
+    // labels of the current metric followed by extra_label if it
+    // isn't empty.
+    void append_name(const char* suffix, util::string_view extra_label);
+
+    std::string* out_;
+    const bool cache_series_;
+    // The escaped name of the current family.
+    std::string name_;
+    // The escaped labels of the current metric, separated by commas:
+    // the text_labels passed to metric(), or labels_buffer_ if the
+    // labels weren't rendered.
+    util::string_view labels_;
+    std::string labels_buffer_;
+    struct ExtraLabel {
+      double value;
+      std::string text;
+    };
+    std::vector<ExtraLabel> extra_labels_;
+    std::size_t extra_label_index_;
+    // The offset in out_ of the series to cache, set on a miss of
+    // write_cached_series().
+    std::size_t series_start_;
+  };
+
+  // Escaping functions for each element of the text format. Doubles
+  // are written with the fewest digits that parse back to the same
+  // value (see impl::format_double()).
   std::string escape_double(double d);
   std::string escape_metric_name(std::string const& s);
   std::string escape_help(std::string const& s);
@@ -58,7 +138,6 @@ namespace prometheus {
 
       static const char* const kInvalidMetricType;
       static const char* const kMissingRequiredField;
-      static const char* const kSummariesNotImplemented;
 
     private:
       const char* reason_;
@@ -1,7 +1,14 @@
 #include "gtest/gtest.h"
 #include "google/protobuf/text_format.h"
+#include "double_format.hh"
 #include "output_formatter.hh"
 
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <random>
 #include <string>
 
 namespace {
@@ -66,6 +73,26 @@ namespace {
     EXPECT_NO_THROW(s = metricfamily_proto_to_string(mf));
   }
 
+  TEST_F(OutputFormatterTest, SummaryTest) {
+    auto mf = make_metricfamily();
+    EXPECT_TRUE(google::protobuf::TextFormat::ParseFromString(
+        "name: \"a\" help: \"b\" type: SUMMARY metric: { label: { name: "
+        "\"x\" value: \"y\" } summary: { sample_count: 3 sample_sum: 4.5 "
+        "quantile { quantile: 0.5 value: 1.5 } "
+        "quantile { quantile: 0.99 value: 2 } } }",
+        &*mf));
+    std::string s;
+    EXPECT_NO_THROW(s = metricfamily_proto_to_string(mf));
+    EXPECT_EQ(
+        "# HELP a b\n"
+        "# TYPE a summary\n"
+        "a{x=\"y\",quantile=\"0.5\"} 1.5\n"
+        "a{x=\"y\",quantile=\"0.99\"} 2\n"
+        "a_sum{x=\"y\"} 4.5\n"
+        "a_count{x=\"y\"} 3\n",
+        s);
+  }
+
   TEST_F(OutputFormatterTest, EmptyMetricFamily) {
     auto mf = make_metricfamily();
     EXPECT_TRUE(google::protobuf::TextFormat::ParseFromString("", &*mf));
@@ -201,4 +228,196 @@ namespace {
     EXPECT_EQ(u8"丢乜上x", escape_help(u8"丢乜上x"));
     EXPECT_EQ(u8"丢\\\\乜\"上\\nx", escape_help(u8"丢\\乜\"上\nx"));
   }
+
+  TEST_F(OutputFormatterTest, InvalidUTF8Escaping) {
+    // Bytes are copied as they are, even if they aren't valid UTF-8.
+    EXPECT_EQ("\"\xff\\\\\xc3\"", escape_label_value("\xff\\\xc3"));
+    EXPECT_EQ(std::string("a\0b", 3), escape_help(std::string("a\0b", 3)));
+  }
+
+  TEST_F(OutputFormatterTest, FindEscapedChar) {
+    // Puts each character at each position of strings of various
+    // lengths, to go through both whole blocks and tails.
+    for (auto find : {&find_escaped_char, &find_escaped_char_swar}) {
+      for (std::size_t size = 0; size < 40; ++size) {
+        std::string s(size, 'x');
+        EXPECT_EQ(s.data() + size, find(s.data(), s.data() + size, true));
+        for (std::size_t i = 0; i < size; ++i) {
+          for (char c : {'\\', '\n', '"'}) {
+            s[i] = c;
+            const char* expected =
+                (c == '"') ? s.data() + size : s.data() + i;
+            EXPECT_EQ(s.data() + i, find(s.data(), s.data() + size, true));
+            EXPECT_EQ(expected, find(s.data(), s.data() + size, false));
+            // A second match doesn't hide the first one.
+            if (i + 1 < size) {
+              s[size - 1] = '\\';
+              EXPECT_EQ(s.data() + i, find(s.data(), s.data() + size, true));
+              s[size - 1] = 'x';
+            }
+            s[i] = 'x';
+          }
+          // Bytes that are one away from the characters.
+          for (char c : {'[', ']', '\t', '\v', '!', '#', '\xdc', '\x8a'}) {
+            s[i] = c;
+            EXPECT_EQ(s.data() + size, find(s.data(), s.data() + size, true));
+            s[i] = 'x';
+          }
+        }
+      }
+    }
+  }
+
+  TEST_F(OutputFormatterTest, DoubleFormatting) {
+    const double kInf = std::numeric_limits<double>::infinity();
+    EXPECT_EQ("+Inf", escape_double(kInf));
+    EXPECT_EQ("-Inf", escape_double(-kInf));
+    EXPECT_EQ("NaN", escape_double(std::nan("")));
+    EXPECT_EQ("0", escape_double(0.0));
+    EXPECT_EQ("-0", escape_double(-0.0));
+    // Whole numbers keep all their digits up to 2^53.
+    EXPECT_EQ("42", escape_double(42));
+    EXPECT_EQ("-42", escape_double(-42));
+    EXPECT_EQ("1234567890123", escape_double(1234567890123.0));
+    EXPECT_EQ("9007199254740992", escape_double(9007199254740992.0));
+    EXPECT_EQ("9.007199254740994e+15", escape_double(9007199254740994.0));
+    EXPECT_EQ("1e+21", escape_double(1e21));
+    // Other numbers use the fewest digits that parse back to them.
+    EXPECT_EQ("4.2", escape_double(4.2));
+    EXPECT_EQ("-1.5", escape_double(-1.5));
+    EXPECT_EQ("0.30000000000000004", escape_double(0.1 + 0.2));
+    EXPECT_EQ("0.3333333333333333", escape_double(1.0 / 3));
+    EXPECT_EQ("123456789012345.6", escape_double(123456789012345.6));
+    EXPECT_EQ("0.0001", escape_double(1e-4));
+    EXPECT_EQ("1e-05", escape_double(1e-5));
+    EXPECT_EQ("1.5e-30", escape_double(1.5e-30));
+    EXPECT_EQ("1e+100", escape_double(1e100));
+    EXPECT_EQ("5e-324", escape_double(5e-324));
+    EXPECT_EQ("2.2250738585072014e-308",
+              escape_double(2.2250738585072014e-308));
+    EXPECT_EQ("-1.7976931348623157e+308",
+              escape_double(-1.7976931348623157e308));
+  }
+
+  TEST_F(OutputFormatterTest, DoubleFormattingRoundTrip) {
+    std::mt19937_64 prng(42);
+    for (int i = 0; i < 100000; ++i) {
+      uint64_t bits = prng();
+      double d;
+      std::memcpy(&d, &bits, sizeof(d));
+      if (std::isnan(d)) {
+        continue;
+      }
+      char buffer[kMaxDoubleLength + 1];
+      *format_double(d, buffer) = '\0';
+      ASSERT_EQ(d, std::strtod(buffer, nullptr)) << buffer;
+    }
+  }
+
+  // Writes mf to a TextSink, which must give the same output as
+  // metricfamily_proto_to_string().
+  void expect_same_text(std::string const& text_proto) {
+    auto mf = make_metricfamily();
+    ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(text_proto, &*mf));
+    std::string s = "previous output\n";
+    TextSink sink(&s);
+    write_metricfamily(*mf, &sink);
+    EXPECT_EQ("previous output\n" + metricfamily_proto_to_string(mf), s);
+  }
+
+  TEST_F(OutputFormatterTest, TextSink) {
+    expect_same_text(
+        "name: \"a\" help: \"b\" type: COUNTER metric: { counter: { value: 4.2 "
+        "} } metric: { label: { name: \"x\" value: \"y\\\"\\n\" } label: { "
+        "name: \"z\" value: \"w\" } counter: { value: 1e20 } }");
+    expect_same_text(
+        "name: \"a\" help: \"b\\\\c\\n\" type: GAUGE metric: { gauge: { value: "
+        "-1.5 } }");
+    expect_same_text(
+        "name: \"a\" help: \"\" type: UNTYPED metric: { untyped: { value: 0 } }");
+    expect_same_text(
+        "name: \"a\" help: \"b\" type: HISTOGRAM metric: { histogram: { "
+        "sample_count: 3 sample_sum: 5.5 bucket { upper_bound: 4.2 "
+        "cumulative_count: 2 } bucket { upper_bound: inf cumulative_count: 3 "
+        "} } } metric: { label: { name: \"x\" value: \"y\" } histogram: { "
+        "sample_count: 0 sample_sum: 0 bucket { upper_bound: inf "
+        "cumulative_count: 0 } } }");
+    expect_same_text(
+        "name: \"a\" help: \"b\" type: SUMMARY metric: { summary: { "
+        "sample_count: 3 sample_sum: 4.5 quantile { quantile: 0.5 value: 1.5 "
+        "} } } metric: { label: { name: \"x\" value: \"y\" } summary: { "
+        "sample_count: 3 sample_sum: 4.5 quantile { quantile: 0.5 value: 1.5 "
+        "} quantile { quantile: 0.99 value: 2 } } }");
+  }
+
+  TEST_F(OutputFormatterTest, TextSinkRenderedLabels) {
+    // Labels rendered by the metric are used as they are, instead of
+    // the labels themselves.
+    std::string s;
+    TextSink sink(&s);
+    MetricSink::Label labels[] = {{"x", "ignored"}};
+    sink.family("a", "b", MetricType::kSummary);
+    sink.metric(labels, 1, "x=\"y\"");
+    sink.quantile(0.5, 1);
+    sink.summary(2, 3.5);
+    sink.metric(labels, 1, util::string_view());
+    sink.quantile(0.5, 1);
+    sink.summary(2, 3.5);
+    EXPECT_EQ(
+        "# HELP a b\n"
+        "# TYPE a summary\n"
+        "a{x=\"y\",quantile=\"0.5\"} 1\n"
+        "a_sum{x=\"y\"} 3.5\n"
+        "a_count{x=\"y\"} 2\n"
+        "a{x=\"ignored\",quantile=\"0.5\"} 1\n"
+        "a_sum{x=\"ignored\"} 3.5\n"
+        "a_count{x=\"ignored\"} 2\n",
+        s);
+  }
+
+  TEST_F(OutputFormatterTest, TextSinkSeriesCache) {
+    std::string s;
+    EXPECT_FALSE(TextSink(&s).caches_series());
+    TextSink sink(&s, true);
+    EXPECT_TRUE(sink.caches_series());
+    MetricSink::SeriesCache cache;
+    sink.family("a", "b", MetricType::kGauge);
+    EXPECT_FALSE(sink.write_cached_series(&cache, 1));
+    sink.metric(nullptr, 0, "x=\"y\"");
+    sink.value(1.5);
+    sink.cache_series(&cache, 1);
+    EXPECT_EQ("a{x=\"y\"} 1.5\n", cache.output);
+    // A different fingerprint misses, the same one writes the output
+    // again.
+    EXPECT_FALSE(sink.write_cached_series(&cache, 2));
+    EXPECT_TRUE(sink.write_cached_series(&cache, 1));
+    EXPECT_EQ(
+        "# HELP a b\n"
+        "# TYPE a gauge\n"
+        "a{x=\"y\"} 1.5\n"
+        "a{x=\"y\"} 1.5\n",
+        s);
+    // Caches written by other sinks are not used.
+    MetricSink::SeriesCache other;
+    other.fingerprint = 1;
+    other.output = "other";
+    EXPECT_FALSE(sink.write_cached_series(&other, 1));
+  }
+
+  TEST_F(OutputFormatterTest, ProtobufSink) {
+    auto mf = make_metricfamily();
+    ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(
+        "name: \"a\" help: \"b\" type: SUMMARY metric: { label: { name: "
+        "\"x\" value: \"y\" } summary: { sample_count: 3 sample_sum: 4.5 "
+        "quantile { quantile: 0.5 value: 1.5 } } }",
+        &*mf));
+    collection_type families;
+    ProtobufSink sink(&families);
+    write_metricfamily(*mf, &sink);
+    write_metricfamily(*mf, &sink);
+    ASSERT_EQ(2U, families.size());
+    for (auto const& f : families) {
+      EXPECT_EQ(mf->SerializeAsString(), f->SerializeAsString());
+    }
+  }
 }
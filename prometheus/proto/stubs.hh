@@ -8,6 +8,7 @@
       class Metric;
       class LabelPair;
       class Histogram;
+      class Summary;
       class Untyped;
       class Gauge;
       class Counter;
@@ -3,8 +3,15 @@
 #include "exceptions.hh"
 #include "prometheus/proto/metrics.pb.h"
 #include "mutex.hh"
+#include "sink.hh"
 
 #include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
 #include <vector>
 
 namespace prometheus {
@@ -15,7 +22,59 @@ namespace prometheus {
       ("Count of exceptions raised by collectors during the metric"
        " collection process."));
 
-    CollectorRegistry::CollectorRegistry() {}
+    Counter<0> collection_timeouts(
+      "prometheus_client_collection_timeouts_total",
+      ("Count of collectors that missed their deadline in a parallel"
+       " collection, whose metrics were dropped."));
+
+    struct CollectorRegistry::RunningTasks {
+      std::mutex mutex;
+      std::condition_variable done;
+      // Once per task.
+      std::vector<ICollector*> collectors;
+      // Once per task that missed its deadline and is still running.
+      std::vector<ICollector*> late;
+
+      // Returns false, without starting a task, if a task of the
+      // collector missed its deadline and is still running.
+      bool start(ICollector* collector) {
+        std::lock_guard<std::mutex> l(mutex);
+        if (std::find(late.begin(), late.end(), collector) != late.end()) {
+          return false;
+        }
+        collectors.push_back(collector);
+        return true;
+      }
+
+      void mark_late(ICollector* collector) {
+        std::lock_guard<std::mutex> l(mutex);
+        late.push_back(collector);
+      }
+
+      void finish(ICollector* collector, bool was_late) {
+        {
+          std::lock_guard<std::mutex> l(mutex);
+          collectors.erase(
+              std::find(collectors.begin(), collectors.end(), collector));
+          if (was_late) {
+            late.erase(std::find(late.begin(), late.end(), collector));
+          }
+        }
+        done.notify_all();
+      }
+
+      void wait(ICollector* collector) {
+        std::unique_lock<std::mutex> l(mutex);
+        done.wait(l, [this, collector]() {
+          return std::find(collectors.begin(), collectors.end(), collector) ==
+                 collectors.end();
+        });
+      }
+    };
+
+    CollectorRegistry::CollectorRegistry()
+        : deadline_(std::chrono::steady_clock::duration::zero()),
+          running_(std::make_shared<RunningTasks>()) {}
     CollectorRegistry::~CollectorRegistry() {}
 
     void CollectorRegistry::register_collector(ICollector* collector) {
@@ -28,17 +87,149 @@ namespace prometheus {
     }
 
     void CollectorRegistry::unregister_collector(ICollector* collector) {
+      {
+        std::unique_lock<impl::shared_timed_mutex> l(mutex_);
+        auto it =
+            std::find(collectors_.begin(), collectors_.end(), collector);
+        if (it == collectors_.end()) {
+          throw err::CollectorManagementException();
+        }
+        collectors_.erase(it);
+      }
+      // Late tasks of a parallel collection may still use the
+      // collector.
+      running_->wait(collector);
+    }
+
+    void CollectorRegistry::set_parallel_collection(
+        Executor executor, std::chrono::steady_clock::duration deadline) {
       std::unique_lock<impl::shared_timed_mutex> l(mutex_);
-      auto it = std::find(collectors_.begin(), collectors_.end(), collector);
-      if (it == collectors_.end()) {
-        throw err::CollectorManagementException();
+      executor_ = std::move(executor);
+      deadline_ = deadline;
+    }
+
+    CollectorRegistry::Executor CollectorRegistry::thread_per_task_executor() {
+      return [](std::function<void()> task) {
+        std::thread(std::move(task)).detach();
+      };
+    }
+
+    template <typename Result>
+    std::vector<std::unique_ptr<Result>> CollectorRegistry::collect_in_parallel(
+        std::function<void(ICollector*, Result*)> const& collect) const {
+      struct Task {
+        ICollector* collector = nullptr;
+        std::chrono::steady_clock::time_point deadline;
+        bool finished = false;
+        // Set when the task missed its deadline, so that it drops its
+        // result.
+        bool abandoned = false;
+        bool failed = false;
+        std::exception_ptr error;
+        std::unique_ptr<Result> result;
+      };
+      // Shared with the tasks, which may outlive the collection.
+      struct State {
+        std::mutex mutex;
+        std::condition_variable done;
+        std::vector<Task> tasks;
+      };
+      auto state = std::make_shared<State>();
+      std::shared_ptr<RunningTasks> running = running_;
+      state->tasks.resize(collectors_.size());
+      for (std::size_t i = 0; i < collectors_.size(); ++i) {
+        ICollector* collector = collectors_[i];
+        state->tasks[i].collector = collector;
+        state->tasks[i].deadline = std::chrono::steady_clock::now() + deadline_;
+        if (!running->start(collector)) {
+          // Its last task is still running late: the collector would
+          // likely miss this deadline too, and each new task could
+          // hold another thread.
+          state->tasks[i].abandoned = true;
+          continue;
+        }
+        try {
+          executor_([state, running, i, collector, collect]() {
+            std::unique_ptr<Result> result(new Result);
+            bool failed = false;
+            std::exception_ptr error;
+            try {
+              collect(collector, result.get());
+            } catch (CollectionException const&) {
+              failed = true;
+            } catch (...) {
+              error = std::current_exception();
+            }
+            bool late;
+            {
+              std::lock_guard<std::mutex> l(state->mutex);
+              Task& task = state->tasks[i];
+              late = task.abandoned;
+              if (!task.abandoned) {
+                task.finished = true;
+                task.failed = failed;
+                task.error = error;
+                task.result = std::move(result);
+              }
+              state->done.notify_all();
+            }
+            running->finish(collector, late);
+          });
+        } catch (...) {
+          running->finish(collector, false);
+          throw;
+        }
+      }
+
+      std::vector<Task> tasks(collectors_.size());
+      {
+        std::unique_lock<std::mutex> l(state->mutex);
+        for (Task& task : state->tasks) {
+          if (!task.abandoned &&
+              !state->done.wait_until(l, task.deadline,
+                                      [&task]() { return task.finished; })) {
+            task.abandoned = true;
+            running->mark_late(task.collector);
+          }
+        }
+        for (std::size_t i = 0; i < tasks.size(); ++i) {
+          Task& task = state->tasks[i];
+          tasks[i].abandoned = task.abandoned;
+          tasks[i].failed = task.failed;
+          tasks[i].error = task.error;
+          tasks[i].result = std::move(task.result);
+        }
       }
-      collectors_.erase(it);
+      std::vector<std::unique_ptr<Result>> results(tasks.size());
+      for (std::size_t i = 0; i < tasks.size(); ++i) {
+        if (tasks[i].abandoned) {
+          collection_timeouts.inc();
+        } else if (tasks[i].failed) {
+          collection_errors.inc();
+        } else if (tasks[i].error) {
+          std::rethrow_exception(tasks[i].error);
+        } else {
+          results[i] = std::move(tasks[i].result);
+        }
+      }
+      return results;
     }
 
     collection_type CollectorRegistry::collect() const {
       impl::shared_lock<impl::shared_timed_mutex> l(mutex_);
       collection_type metrics;
+      if (executor_) {
+        auto results = collect_in_parallel<collection_type>(
+            [](ICollector* c, collection_type* metrics) {
+              *metrics = c->collect();
+            });
+        for (auto& collected_metrics : results) {
+          if (collected_metrics) {
+            metrics.splice(metrics.begin(), *collected_metrics);
+          }
+        }
+        return metrics;
+      }
       for (auto const& c : collectors_) {
 	try {
 	  collection_type collected_metrics = c->collect();
@@ -50,6 +241,29 @@ namespace prometheus {
       return metrics;
     }
 
+    void CollectorRegistry::collect(MetricSink* sink) const {
+      impl::shared_lock<impl::shared_timed_mutex> l(mutex_);
+      if (executor_) {
+        auto results = collect_in_parallel<BufferedSink>(
+            [](ICollector* c, BufferedSink* buffer) { c->collect(buffer); });
+        for (auto it = results.rbegin(); it != results.rend(); ++it) {
+          if (*it) {
+            (*it)->replay(sink);
+          }
+        }
+        return;
+      }
+      // Backwards, as collect() prepends the metrics of each
+      // collector.
+      for (auto it = collectors_.rbegin(); it != collectors_.rend(); ++it) {
+	try {
+	  (*it)->collect(sink);
+	} catch (CollectionException const&) {
+	  collection_errors.inc();
+	}
+      }
+    }
+
   } /* namespace impl */
 
 } /* namespace prometheus */
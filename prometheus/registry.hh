@@ -5,6 +5,9 @@
 #include "family.hh"
 #include "mutex.hh"
 
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <ostream>
 #include <list>
 #include <vector>
@@ -18,6 +21,9 @@ namespace prometheus {
       // Collectors, each of whom represents a collection of metrics.
 
      public:
+      // Runs a task, e.g. on a thread pool.
+      typedef std::function<void(std::function<void()>)> Executor;
+
       CollectorRegistry();
       ~CollectorRegistry();
 
@@ -26,6 +32,10 @@ namespace prometheus {
       // MetricFamily objects and must delete them to avoid leaks.
       collection_type collect() const;
 
+      // Writes the metrics of all collectors to a sink, in the same
+      // order as collect().
+      void collect(MetricSink* sink) const;
+
       // Register or unregister a collector. Registered collectors are
       // included in collections. Registering a collector twice, or
       // unregistering a collector that isn't registered, will throw a
@@ -33,12 +43,53 @@ namespace prometheus {
       void register_collector(ICollector* collector);
       void unregister_collector(ICollector* collector);
 
+      // Makes collections run each collector as a task of executor,
+      // concurrently, so that a slow collector doesn't delay the
+      // others, and wait for each task at most deadline after it was
+      // submitted. The metrics of the collectors that miss their
+      // deadline are dropped, and counted by
+      // prometheus_client_collection_timeouts_total. A late task is
+      // left running, but a collector gets no new task until it
+      // returns: in the meantime, collections count the collector as
+      // a timeout right away. A hung collector thus holds at most one
+      // task (one thread with thread_per_task_executor()), however
+      // many collections run. The metrics of
+      // the others are merged in the same order as in sequential
+      // collections. Collections to a sink buffer the metrics of each
+      // collector (see BufferedSink), so they don't use series caches.
+      //
+      // A null executor makes collections sequential again, which is
+      // the default. Tasks may outlive their collection, so
+      // unregister_collector() waits for the running tasks of the
+      // collector it removes. The registry itself can be destroyed
+      // while tasks are running.
+      void set_parallel_collection(Executor executor,
+                                   std::chrono::steady_clock::duration deadline);
+
+      // An executor that runs each task on a new (detached) thread.
+      static Executor thread_per_task_executor();
+
      private:
       CollectorRegistry(CollectorRegistry const&) = delete;
       CollectorRegistry operator=(CollectorRegistry const&) = delete;
 
+      // Runs collect(collector, result) for each collector on
+      // executor_, and returns the results in the order of the
+      // collectors, with null results for the collectors that failed
+      // or missed their deadline. Collections are run with mutex_
+      // held.
+      template <typename Result>
+      std::vector<std::unique_ptr<Result>> collect_in_parallel(
+          std::function<void(ICollector*, Result*)> const& collect) const;
+
       mutable impl::shared_timed_mutex mutex_;
       std::vector<ICollector*> collectors_;
+      Executor executor_;
+      std::chrono::steady_clock::duration deadline_;
+
+      // The collectors with a running task, shared with the tasks.
+      struct RunningTasks;
+      std::shared_ptr<RunningTasks> running_;
     };
 
     // The global registry is available for clients to collect all
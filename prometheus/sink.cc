@@ -0,0 +1,270 @@
+#include "sink.hh"
+#include "prometheus/proto/metrics.pb.h"
+#include "util/hash.hh"
+
+#include <cstring>
+#include <vector>
+
+namespace prometheus {
+  namespace impl {
+
+    using ::prometheus::client::Bucket;
+    using ::prometheus::client::Histogram;
+    using ::prometheus::client::LabelPair;
+    using ::prometheus::client::Metric;
+    using ::prometheus::client::Quantile;
+    using ::prometheus::client::Summary;
+
+    namespace {
+      ::prometheus::client::MetricType to_proto(MetricType type) {
+        switch (type) {
+          case MetricType::kCounter:
+            return ::prometheus::client::MetricType::COUNTER;
+          case MetricType::kGauge:
+            return ::prometheus::client::MetricType::GAUGE;
+          case MetricType::kSummary:
+            return ::prometheus::client::MetricType::SUMMARY;
+          case MetricType::kHistogram:
+            return ::prometheus::client::MetricType::HISTOGRAM;
+          case MetricType::kUntyped:
+            break;
+        }
+        return ::prometheus::client::MetricType::UNTYPED;
+      }
+
+      MetricType from_proto(::prometheus::client::MetricType type) {
+        switch (type) {
+          case ::prometheus::client::MetricType::COUNTER:
+            return MetricType::kCounter;
+          case ::prometheus::client::MetricType::GAUGE:
+            return MetricType::kGauge;
+          case ::prometheus::client::MetricType::SUMMARY:
+            return MetricType::kSummary;
+          case ::prometheus::client::MetricType::HISTOGRAM:
+            return MetricType::kHistogram;
+          default:
+            return MetricType::kUntyped;
+        }
+      }
+    } /* namespace */
+
+    ProtobufSink::ProtobufSink(collection_type* families)
+        : families_(families),
+          family_(nullptr),
+          type_(MetricType::kUntyped),
+          metric_(nullptr) {}
+
+    ProtobufSink::ProtobufSink(MetricFamily* mf)
+        : families_(nullptr),
+          family_(mf),
+          type_(MetricType::kUntyped),
+          metric_(nullptr) {}
+
+    void ProtobufSink::family(std::string const& name, std::string const& help,
+                              MetricType type) {
+      if (families_ != nullptr) {
+        family_ = new MetricFamily;
+        families_->push_back(MetricFamilyPtr(family_));
+      }
+      family_->set_name(name);
+      family_->set_help(help);
+      family_->set_type(to_proto(type));
+      type_ = type;
+    }
+
+    void ProtobufSink::metric(Label const* labels, std::size_t count,
+                              util::string_view /*text_labels*/) {
+      metric_ = family_->add_metric();
+      for (std::size_t i = 0; i < count; ++i) {
+        LabelPair* l = metric_->add_label();
+        l->set_name(labels[i].name.data(), labels[i].name.size());
+        l->set_value(labels[i].value.data(), labels[i].value.size());
+      }
+    }
+
+    void ProtobufSink::value(double value) {
+      switch (type_) {
+        case MetricType::kCounter:
+          metric_->mutable_counter()->set_value(value);
+          break;
+        case MetricType::kGauge:
+          metric_->mutable_gauge()->set_value(value);
+          break;
+        default:
+          metric_->mutable_untyped()->set_value(value);
+          break;
+      }
+    }
+
+    void ProtobufSink::bucket(double upper_bound, uint64_t cumulative_count) {
+      Bucket* b = metric_->mutable_histogram()->add_bucket();
+      b->set_upper_bound(upper_bound);
+      b->set_cumulative_count(cumulative_count);
+    }
+
+    void ProtobufSink::histogram(uint64_t count, double sum) {
+      Histogram* h = metric_->mutable_histogram();
+      h->set_sample_count(count);
+      h->set_sample_sum(sum);
+    }
+
+    void ProtobufSink::quantile(double quantile, double value) {
+      Quantile* q = metric_->mutable_summary()->add_quantile();
+      q->set_quantile(quantile);
+      q->set_value(value);
+    }
+
+    void ProtobufSink::summary(uint64_t count, double sum) {
+      Summary* s = metric_->mutable_summary();
+      s->set_sample_count(count);
+      s->set_sample_sum(sum);
+    }
+
+    void write_metricfamily(MetricFamily const& mf, MetricSink* sink) {
+      MetricType type = from_proto(mf.type());
+      sink->family(mf.name(), mf.help(), type);
+      std::vector<MetricSink::Label> labels;
+      for (Metric const& m : mf.metric()) {
+        labels.clear();
+        for (LabelPair const& l : m.label()) {
+          labels.push_back({l.name(), l.value()});
+        }
+        sink->metric(labels.data(), labels.size(), util::string_view());
+        switch (type) {
+          case MetricType::kCounter:
+            sink->value(m.counter().value());
+            break;
+          case MetricType::kGauge:
+            sink->value(m.gauge().value());
+            break;
+          case MetricType::kUntyped:
+            sink->value(m.untyped().value());
+            break;
+          case MetricType::kHistogram:
+            for (Bucket const& b : m.histogram().bucket()) {
+              sink->bucket(b.upper_bound(), b.cumulative_count());
+            }
+            sink->histogram(m.histogram().sample_count(),
+                            m.histogram().sample_sum());
+            break;
+          case MetricType::kSummary:
+            for (Quantile const& q : m.summary().quantile()) {
+              sink->quantile(q.quantile(), q.value());
+            }
+            sink->summary(m.summary().sample_count(),
+                          m.summary().sample_sum());
+            break;
+        }
+      }
+    }
+
+    void ValueRecorder::value(double value) {
+      calls_.push_back(Call{Call::kValue, value, 0, 0});
+    }
+
+    void ValueRecorder::bucket(double upper_bound,
+                               uint64_t cumulative_count) {
+      calls_.push_back(Call{Call::kBucket, upper_bound, 0, cumulative_count});
+    }
+
+    void ValueRecorder::histogram(uint64_t count, double sum) {
+      calls_.push_back(Call{Call::kHistogram, sum, 0, count});
+    }
+
+    void ValueRecorder::quantile(double quantile, double value) {
+      calls_.push_back(Call{Call::kQuantile, quantile, value, 0});
+    }
+
+    void ValueRecorder::summary(uint64_t count, double sum) {
+      calls_.push_back(Call{Call::kSummary, sum, 0, count});
+    }
+
+    uint64_t ValueRecorder::fingerprint() const {
+      util::Hasher hasher;
+      // The kinds of calls don't need to be hashed: they only depend
+      // on the type of the value (and its buckets or quantiles, which
+      // are hashed), which is the same in each collection of a series.
+      for (Call const& c : calls_) {
+        uint64_t words[3] = {0, 0, c.n};
+        // Hashes the bits of the doubles, so that e.g. NaN is equal to
+        // itself.
+        std::memcpy(&words[0], &c.x, sizeof(double));
+        std::memcpy(&words[1], &c.y, sizeof(double));
+        hasher.add(reinterpret_cast<const char*>(words), sizeof(words));
+      }
+      return hasher.finish();
+    }
+
+    void ValueRecorder::replay(MetricSink* sink) const {
+      for (Call const& c : calls_) {
+        switch (c.kind) {
+          case Call::kValue:
+            sink->value(c.x);
+            break;
+          case Call::kBucket:
+            sink->bucket(c.x, c.n);
+            break;
+          case Call::kHistogram:
+            sink->histogram(c.n, c.x);
+            break;
+          case Call::kQuantile:
+            sink->quantile(c.x, c.y);
+            break;
+          case Call::kSummary:
+            sink->summary(c.n, c.x);
+            break;
+        }
+      }
+    }
+
+    void BufferedSink::family(std::string const& name,
+                              std::string const& help, MetricType type) {
+      families_.push_back(Family{name, help, type, {}});
+    }
+
+    void BufferedSink::metric(Label const* labels, std::size_t count,
+                              util::string_view text_labels) {
+      families_.back().metrics.emplace_back();
+      Metric& m = families_.back().metrics.back();
+      for (std::size_t i = 0; i < count; ++i) {
+        m.labels.push_back(labels[i].name.to_string());
+        m.labels.push_back(labels[i].value.to_string());
+      }
+      m.text_labels = text_labels.to_string();
+    }
+
+    void BufferedSink::value(double value) { values().value(value); }
+
+    void BufferedSink::bucket(double upper_bound, uint64_t cumulative_count) {
+      values().bucket(upper_bound, cumulative_count);
+    }
+
+    void BufferedSink::histogram(uint64_t count, double sum) {
+      values().histogram(count, sum);
+    }
+
+    void BufferedSink::quantile(double quantile, double value) {
+      values().quantile(quantile, value);
+    }
+
+    void BufferedSink::summary(uint64_t count, double sum) {
+      values().summary(count, sum);
+    }
+
+    void BufferedSink::replay(MetricSink* sink) const {
+      std::vector<Label> labels;
+      for (Family const& f : families_) {
+        sink->family(f.name, f.help, f.type);
+        for (Metric const& m : f.metrics) {
+          labels.clear();
+          for (std::size_t i = 0; i < m.labels.size(); i += 2) {
+            labels.push_back({m.labels[i], m.labels[i + 1]});
+          }
+          sink->metric(labels.data(), labels.size(), m.text_labels);
+          m.values.replay(sink);
+        }
+      }
+    }
+
+  } /* namespace impl */
+} /* namespace prometheus */
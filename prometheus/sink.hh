@@ -0,0 +1,196 @@
+#ifndef PROMETHEUS_SINK_HH__
+#define PROMETHEUS_SINK_HH__
+
+#include "family.hh"
+#include "proto/stubs.hh"
+#include "util/string_view.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace prometheus {
+
+  // The type of the metrics of a family.
+  enum class MetricType { kCounter, kGauge, kSummary, kHistogram, kUntyped };
+
+  class MetricSink {
+    // A MetricSink receives the metrics of a collection as a sequence
+    // of calls, so that they can be written out as they are collected
+    // (e.g. in the text format, see TextSink) without building
+    // MetricFamily protobufs first. Metrics and collectors call, for
+    // each metric family:
+    //
+    //   - family(), then for each metric of the family:
+    //   - metric(), with the labels of the metric, and optionally the
+    //     same labels already rendered for the text format (see
+    //     append_text_label(): name="value" pairs separated by commas),
+    //     which metrics keep for each of their children so that they
+    //     aren't escaped again on each collection, then depending on
+    //     the type of the family:
+    //     - counters, gauges and untyped metrics: value(),
+    //     - histograms: bucket() for each bucket, in increasing order
+    //       of upper bounds and ending with +Inf, then histogram(),
+    //     - summaries: quantile() for each quantile, then summary().
+    //
+    // Strings passed to a sink are only valid during the call.
+    //
+    // A sink may also reuse its output for a series (a metric and its
+    // values) from one collection to the next, if the values didn't
+    // change. Metrics that keep a SeriesCache for each series first
+    // call write_cached_series() with a fingerprint of the values, and
+    // if it returns false, write the series as above, followed by
+    // cache_series().
+   public:
+    struct Label {
+      util::string_view name;
+      util::string_view value;
+    };
+
+    struct SeriesCache {
+      // Identifies the kind of sink that wrote the output (e.g. the
+      // address of a static member of the sink's class), or null if
+      // there is none.
+      const void* format = nullptr;
+      uint64_t fingerprint = 0;
+      std::string output;
+    };
+
+    virtual ~MetricSink() {}
+
+    virtual void family(std::string const& name, std::string const& help,
+                        MetricType type) = 0;
+    // text_labels is empty if the labels aren't rendered (or if
+    // there are none).
+    virtual void metric(Label const* labels, std::size_t count,
+                        util::string_view text_labels) = 0;
+
+    virtual void value(double value) = 0;
+
+    virtual void bucket(double upper_bound, uint64_t cumulative_count) = 0;
+    virtual void histogram(uint64_t count, double sum) = 0;
+
+    virtual void quantile(double quantile, double value) = 0;
+    virtual void summary(uint64_t count, double sum) = 0;
+
+    // Whether the sink uses series caches, so that metrics only
+    // compute fingerprints for those that do.
+    virtual bool caches_series() const { return false; }
+    // Writes the cached output of a series, and returns true, if it
+    // was written by this kind of sink for values with the same
+    // fingerprint.
+    virtual bool write_cached_series(SeriesCache const* /*cache*/,
+                                     uint64_t /*fingerprint*/) {
+      return false;
+    }
+    // Stores the output of the series written since the last call to
+    // write_cached_series() in the cache.
+    virtual void cache_series(SeriesCache* /*cache*/,
+                              uint64_t /*fingerprint*/) {}
+  };
+
+  namespace impl {
+
+    class ProtobufSink : public MetricSink {
+      // A sink that builds MetricFamily protobufs, for the collect()
+      // methods that return them.
+     public:
+      // Appends a new MetricFamily to families for each family.
+      explicit ProtobufSink(collection_type* families);
+      // Writes to mf, which is meant for a single family.
+      explicit ProtobufSink(MetricFamily* mf);
+
+      virtual void family(std::string const& name, std::string const& help,
+                          MetricType type);
+      virtual void metric(Label const* labels, std::size_t count,
+                          util::string_view text_labels);
+      virtual void value(double value);
+      virtual void bucket(double upper_bound, uint64_t cumulative_count);
+      virtual void histogram(uint64_t count, double sum);
+      virtual void quantile(double quantile, double value);
+      virtual void summary(uint64_t count, double sum);
+
+     private:
+      collection_type* families_;
+      MetricFamily* family_;
+      MetricType type_;
+      ::prometheus::client::Metric* metric_;
+    };
+
+    // Writes the metrics of a MetricFamily protobuf to a sink, for
+    // collectors that only build protobufs.
+    void write_metricfamily(MetricFamily const& mf, MetricSink* sink);
+
+    class ValueRecorder : public MetricSink {
+      // Records what a value writes to a sink (through
+      // collect_value()), to compute the fingerprint of a series
+      // before writing it, and then replay it to the actual sink
+      // without collecting the value twice. The fingerprint is a
+      // 64-bit hash, so different values get the same fingerprint
+      // with a negligible probability.
+     public:
+      void clear() { calls_.clear(); }
+      uint64_t fingerprint() const;
+      void replay(MetricSink* sink) const;
+
+      virtual void family(std::string const& /*name*/,
+                          std::string const& /*help*/, MetricType /*type*/) {}
+      virtual void metric(Label const* /*labels*/, std::size_t /*count*/,
+                          util::string_view /*text_labels*/) {}
+      virtual void value(double value);
+      virtual void bucket(double upper_bound, uint64_t cumulative_count);
+      virtual void histogram(uint64_t count, double sum);
+      virtual void quantile(double quantile, double value);
+      virtual void summary(uint64_t count, double sum);
+
+     private:
+      struct Call {
+        enum Kind { kValue, kBucket, kHistogram, kQuantile, kSummary };
+        Kind kind;
+        double x;
+        double y;
+        uint64_t n;
+      };
+      std::vector<Call> calls_;
+    };
+
+    class BufferedSink : public MetricSink {
+      // Records the metrics written to it, with copies of their
+      // strings, so that they can be replayed to another sink later
+      // (e.g. when a collector runs on another thread, see
+      // CollectorRegistry::set_parallel_collection()).
+     public:
+      void replay(MetricSink* sink) const;
+
+      virtual void family(std::string const& name, std::string const& help,
+                          MetricType type);
+      virtual void metric(Label const* labels, std::size_t count,
+                          util::string_view text_labels);
+      virtual void value(double value);
+      virtual void bucket(double upper_bound, uint64_t cumulative_count);
+      virtual void histogram(uint64_t count, double sum);
+      virtual void quantile(double quantile, double value);
+      virtual void summary(uint64_t count, double sum);
+
+     private:
+      struct Metric {
+        std::vector<std::string> labels;  // Names and values.
+        std::string text_labels;
+        ValueRecorder values;
+      };
+      struct Family {
+        std::string name;
+        std::string help;
+        MetricType type;
+        std::vector<Metric> metrics;
+      };
+      ValueRecorder& values() { return families_.back().metrics.back().values; }
+
+      std::vector<Family> families_;
+    };
+
+  } /* namespace impl */
+} /* namespace prometheus */
+
+#endif /* PROMETHEUS_SINK_HH__ */
@@ -0,0 +1,326 @@
+#ifndef PROMETHEUS_SLAB_HH__
+#define PROMETHEUS_SLAB_HH__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define PROMETHEUS_SLAB_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define PROMETHEUS_SLAB_ASAN 1
+#endif
+#endif
+#ifdef PROMETHEUS_SLAB_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+namespace prometheus {
+  namespace impl {
+
+    class SlabBase;
+
+    struct SlabSlot {
+      // The header of a slot of a Slab. Objects in a slab are
+      // reference counted through their slot, so that references on
+      // them don't depend on their type (see ChildHandle).
+      std::atomic<uint32_t> refs{0};
+      // Whether the object is attached (see Slab::attach()).
+      bool attached = false;
+      SlabSlot* next_free = nullptr;
+      SlabBase* slab = nullptr;
+
+      // Takes and releases a reference on the object in this
+      // slot. Releasing the last reference destroys the object and
+      // frees the slot. Both can be called from any thread.
+      void acquire() { refs.fetch_add(1, std::memory_order_relaxed); }
+      inline void release();
+    };
+
+    class SlabBase {
+     public:
+      // Releases the reference of the owner of the slab, which is
+      // destroyed once all of its objects are destroyed too, so that
+      // references on objects may outlive the owner.
+      void release_slab() { release_objects(1); }
+
+     protected:
+      SlabBase() : objects_(1) {}
+      virtual ~SlabBase() {}
+
+      void acquire_object() {
+        objects_.fetch_add(1, std::memory_order_relaxed);
+      }
+      void release_objects(std::size_t count) {
+        if (objects_.fetch_sub(count, std::memory_order_acq_rel) == count) {
+          delete this;
+        }
+      }
+
+     private:
+      friend struct SlabSlot;
+      virtual void destroy(SlabSlot* slot) = 0;
+
+      // The number of objects, plus 1 until the owner releases the
+      // slab.
+      std::atomic<std::size_t> objects_;
+    };
+
+    inline void SlabSlot::release() {
+      if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        slab->destroy(this);
+      }
+    }
+
+    template <class T>
+    class Slab : public SlabBase {
+      // Stores objects of type T in chunks of contiguous slots. The
+      // first chunk has a single slot and each new chunk is twice as
+      // large as the previous one, up to kMaxChunkSize, so that the
+      // many metrics with a handful of children stay small. Freed
+      // slots are reused before allocating a new chunk,
+      // so finding a slot for an object usually doesn't allocate, and
+      // objects never move. The constructor of T may still allocate
+      // for the state it owns (strings, arrays, ...).
+      //
+      // The owner of a slab marks the objects it holds a reference on
+      // as attached, and can then visit them by scanning the slots in
+      // memory order instead of chasing pointers. create(), attach(),
+      // detach() and for_each_attached() must not run concurrently
+      // (LabeledMetric calls them with a lock held), but references
+      // can be released from any thread.
+     public:
+      static const std::size_t kMaxChunkSize = 64;
+
+      Slab() {}
+      Slab(Slab const&) = delete;
+      Slab& operator=(Slab const&) = delete;
+
+      // Creates an object, with a single reference on it.
+      template <typename... Args>
+      T* create(Args&&... args) {
+        Slot* slot = allocate();
+        try {
+          new (&slot->storage) T(std::forward<Args>(args)...);
+        } catch (...) {
+          free(slot);
+          throw;
+        }
+        slot->header.refs.store(1, std::memory_order_relaxed);
+        acquire_object();
+        return slot->object();
+      }
+
+      static SlabSlot* slot(T* object) {
+        return &reinterpret_cast<Slot*>(
+                    reinterpret_cast<char*>(object) - offsetof(Slot, storage))
+                    ->header;
+      }
+
+      static void attach(T* object) { slot(object)->attached = true; }
+      static void detach(T* object) { slot(object)->attached = false; }
+
+      // Calls f on each attached object, in memory order.
+      template <typename F>
+      void for_each_attached(F f) const {
+        for (Chunk const& chunk : chunks_) {
+          for (std::size_t i = 0; i < chunk.size; ++i) {
+            Slot& s = chunk.slots[i];
+            if (s.header.attached) {
+              f(*s.object());
+            }
+          }
+        }
+      }
+
+     private:
+      struct Slot {
+        SlabSlot header;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        T* object() { return reinterpret_cast<T*>(&storage); }
+      };
+      struct Chunk {
+        explicit Chunk(std::size_t size) : slots(new Slot[size]), size(size) {}
+        std::unique_ptr<Slot[]> slots;
+        std::size_t size;
+      };
+
+      ~Slab() {}
+
+      Slot* allocate() {
+        std::lock_guard<std::mutex> l(free_mutex_);
+        if (free_ == nullptr) {
+          std::size_t size = chunks_.empty() ? 1 : 2 * chunks_.back().size;
+          if (size > kMaxChunkSize) {
+            size = kMaxChunkSize;
+          }
+          chunks_.emplace_back(size);
+          // Pushed backwards, so that slots are used in memory order.
+          Slot* slots = chunks_.back().slots.get();
+          for (std::size_t i = size; i-- > 0;) {
+            slots[i].header.slab = this;
+            slots[i].header.next_free = free_;
+            free_ = &slots[i].header;
+            poison(&slots[i]);
+          }
+        }
+        SlabSlot* slot = free_;
+        free_ = slot->next_free;
+        unpoison(reinterpret_cast<Slot*>(slot));
+        return reinterpret_cast<Slot*>(slot);
+      }
+
+      void free(Slot* slot) {
+        poison(slot);
+        std::lock_guard<std::mutex> l(free_mutex_);
+        slot->header.next_free = free_;
+        free_ = &slot->header;
+      }
+
+      // Under AddressSanitizer, the storage of free slots is
+      // poisoned, so that uses of destroyed objects are reported
+      // like uses of freed memory.
+      static void poison(Slot* slot) {
+#ifdef PROMETHEUS_SLAB_ASAN
+        __asan_poison_memory_region(&slot->storage, sizeof(slot->storage));
+#else
+        (void)slot;
+#endif
+      }
+      static void unpoison(Slot* slot) {
+#ifdef PROMETHEUS_SLAB_ASAN
+        __asan_unpoison_memory_region(&slot->storage, sizeof(slot->storage));
+#else
+        (void)slot;
+#endif
+      }
+
+      virtual void destroy(SlabSlot* header) {
+        Slot* slot = reinterpret_cast<Slot*>(header);
+        slot->object()->~T();
+        free(slot);
+        release_objects(1);
+      }
+
+      std::vector<Chunk> chunks_;
+      // Protects the free list, as slots are freed by the last
+      // reference on their object, from any thread.
+      std::mutex free_mutex_;
+      SlabSlot* free_ = nullptr;
+    };
+
+    template <class T>
+    class SlabIndex {
+      // A hash table of pointers to objects (in a Slab), with open
+      // addressing and linear probing: entries are stored with their
+      // hash in a single array, so inserting an object doesn't
+      // allocate (except when the array grows), and growing the array
+      // reuses the stored hashes. Erasing an entry shifts the
+      // following ones back instead of leaving a tombstone.
+     public:
+      SlabIndex() : size_(0) {}
+
+      // Returns the object with this hash for which eq returns true,
+      // or nullptr.
+      template <typename Eq>
+      T* find(std::size_t hash, Eq eq) const {
+        if (entries_.empty()) {
+          return nullptr;
+        }
+        for (std::size_t i = hash & mask();; i = (i + 1) & mask()) {
+          Entry const& e = entries_[i];
+          if (e.object == nullptr) {
+            return nullptr;
+          }
+          if (e.hash == hash && eq(*e.object)) {
+            return e.object;
+          }
+        }
+      }
+
+      // Inserts an object that isn't in the index yet.
+      void insert(std::size_t hash, T* object) {
+        // Keeps the load factor under 1/2.
+        if (2 * (size_ + 1) > entries_.size()) {
+          grow();
+        }
+        place(Entry{hash, object});
+        ++size_;
+      }
+
+      // Erases an object of the index.
+      void erase(std::size_t hash, T* object) {
+        std::size_t i = hash & mask();
+        while (entries_[i].object != object) {
+          i = (i + 1) & mask();
+        }
+        // Moves back the following entries of the run that would not
+        // be found anymore through the hole.
+        for (std::size_t j = (i + 1) & mask(); entries_[j].object != nullptr;
+             j = (j + 1) & mask()) {
+          std::size_t home = entries_[j].hash & mask();
+          if (((j - home) & mask()) >= ((j - i) & mask())) {
+            entries_[i] = entries_[j];
+            i = j;
+          }
+        }
+        entries_[i] = Entry();
+        --size_;
+      }
+
+      // Calls f on each object and empties the index.
+      template <typename F>
+      void clear(F f) {
+        for (Entry& e : entries_) {
+          if (e.object != nullptr) {
+            f(e.object);
+            e = Entry();
+          }
+        }
+        size_ = 0;
+      }
+
+      std::size_t size() const { return size_; }
+
+     private:
+      struct Entry {
+        std::size_t hash;
+        T* object;
+      };
+
+      std::size_t mask() const { return entries_.size() - 1; }
+
+      void place(Entry const& entry) {
+        std::size_t i = entry.hash & mask();
+        while (entries_[i].object != nullptr) {
+          i = (i + 1) & mask();
+        }
+        entries_[i] = entry;
+      }
+
+      void grow() {
+        std::vector<Entry> entries(
+            entries_.empty() ? 16 : 2 * entries_.size(), Entry());
+        entries.swap(entries_);
+        for (Entry const& e : entries) {
+          if (e.object != nullptr) {
+            place(e);
+          }
+        }
+      }
+
+      std::vector<Entry> entries_;
+      std::size_t size_;
+    };
+
+  } /* namespace impl */
+} /* namespace prometheus */
+
+#endif /* PROMETHEUS_SLAB_HH__ */
@@ -1,7 +1,7 @@
 #include "collector.hh"
 #include "registry.hh"
+#include "sink.hh"
 #include "standard_exports.hh"
-#include "prometheus/proto/metrics.pb.h"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/resource.h>
@@ -94,18 +94,15 @@ namespace prometheus {
 
     class ProcessCollector : public ICollector {
     private:
-      // Convenience function to add a gauge to the list of
-      // MetricFamilies and set its name/help/type and one value.
-      static void set_gauge(collection_type& l,
+      // Convenience function to write a family with a single gauge
+      // and its name/help/type and value to a sink.
+      static void set_gauge(MetricSink* sink,
                             std::string const& name,
                             std::string const& help,
                             double value) {
-        MetricFamily* mf = new MetricFamily();
-        mf->set_name(name);
-        mf->set_help(help);
-        mf->set_type(::prometheus::client::MetricType::GAUGE);
-        mf->add_metric()->mutable_gauge()->set_value(value);
-        l.push_back(MetricFamilyPtr(mf));
+        sink->family(name, help, MetricType::kGauge);
+        sink->metric(nullptr, 0, util::string_view());
+        sink->value(value);
       }
 
       const double pagesize_;
@@ -124,6 +121,12 @@ namespace prometheus {
 
       collection_type collect() const {
         collection_type l;
+        ProtobufSink sink(&l);
+        collect(&sink);
+        return l;
+      }
+
+      void collect(MetricSink* l) const {
         ProcSelfStatReader pss;
         ProcStatReader ps;
         ProcSelfFdReader psfd;
@@ -135,7 +138,6 @@ namespace prometheus {
         set_gauge(l, "process_cpu_seconds_total", "Total user and system CPU time spent in seconds.", (double)(pss.utime + pss.stime) / ticks_per_ms_);
         set_gauge(l, "process_open_fds", "Number of open file descriptors.", psfd.num_open_files);
         set_gauge(l, "process_max_fds", "Maximum number of open file descriptors.", psl.max_open_files);
-        return l;
       }
     };
   } /* namespace impl */
@@ -0,0 +1,122 @@
+#include "text_escape.hh"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace prometheus {
+
+  // Appends s to out, escaping the characters found by
+  // impl::find_escaped_char(). Runs of characters that don't need
+  // escaping are appended at once.
+  static void append_escaped(std::string* out, util::string_view s,
+                             bool quote) {
+    const char* p = s.begin();
+    const char* end = s.end();
+    while (true) {
+      const char* next = impl::find_escaped_char(p, end, quote);
+      out->append(p, next - p);
+      if (next == end) {
+        return;
+      }
+      out->append(1, '\\').append(1, *next == '\n' ? 'n' : *next);
+      p = next + 1;
+    }
+  }
+
+  void append_escaped_help(std::string* out, util::string_view s) {
+    append_escaped(out, s, false);
+  }
+
+  void append_escaped_label_value(std::string* out, util::string_view s) {
+    out->append(1, '"');
+    append_escaped(out, s, true);
+    out->append(1, '"');
+  }
+
+  void append_text_label(std::string* out, util::string_view name,
+                         util::string_view value) {
+    // Label names are valid names (see names.hh), which never need
+    // escaping.
+    out->append(name.data(), name.size()).append(1, '=');
+    append_escaped_label_value(out, value);
+  }
+
+  namespace impl {
+
+    // Characters that need escaping are found by comparing each byte
+    // with '\\', '\n' and '"'. When quotes don't need escaping, '"' is
+    // replaced with a second '\\', so that the same comparisons can
+    // be used.
+
+    const char* find_escaped_char_swar(const char* begin, const char* end,
+                                       bool quote) {
+      const uint64_t kOnes = 0x0101010101010101ULL;
+      const uint64_t kHighs = 0x8080808080808080ULL;
+      const uint64_t backslashes = kOnes * '\\';
+      const uint64_t newlines = kOnes * '\n';
+      const uint64_t quotes = kOnes * (quote ? '"' : '\\');
+      const char* p = begin;
+      for (; p + 8 <= end; p += 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        // A byte of x1 (x2, x3) is zero iff the same byte of word is
+        // a backslash (newline, quote). (x - kOnes) & ~x has the high
+        // bit of each zero byte of x set, and may only have false
+        // positives above a zero byte, so a block is only flagged if
+        // it has a match, which is then found by the loop below.
+        uint64_t x1 = word ^ backslashes;
+        uint64_t x2 = word ^ newlines;
+        uint64_t x3 = word ^ quotes;
+        uint64_t found = ((x1 - kOnes) & ~x1) | ((x2 - kOnes) & ~x2) |
+                         ((x3 - kOnes) & ~x3);
+        if ((found & kHighs) != 0) {
+          break;
+        }
+      }
+      for (; p < end; ++p) {
+        if (*p == '\\' || *p == '\n' || (quote && *p == '"')) {
+          return p;
+        }
+      }
+      return end;
+    }
+
+#ifdef __SSE2__
+
+    const char* find_escaped_char(const char* begin, const char* end,
+                                  bool quote) {
+      const __m128i backslashes = _mm_set1_epi8('\\');
+      const __m128i newlines = _mm_set1_epi8('\n');
+      const __m128i quotes = _mm_set1_epi8(quote ? '"' : '\\');
+      const char* p = begin;
+      for (; p + 16 <= end; p += 16) {
+        __m128i block =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i found = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, backslashes),
+                         _mm_cmpeq_epi8(block, newlines)),
+            _mm_cmpeq_epi8(block, quotes));
+        int mask = _mm_movemask_epi8(found);
+        if (mask != 0) {
+          return p + __builtin_ctz(mask);
+        }
+      }
+      return find_escaped_char_swar(p, end, quote);
+    }
+
+#else  /* __SSE2__ */
+
+    const char* find_escaped_char(const char* begin, const char* end,
+                                  bool quote) {
+      return find_escaped_char_swar(begin, end, quote);
+    }
+
+#endif  /* __SSE2__ */
+
+  } /* namespace impl */
+} /* namespace prometheus */
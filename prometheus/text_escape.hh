@@ -0,0 +1,38 @@
+#ifndef PROMETHEUS_TEXT_ESCAPE_HH__
+#define PROMETHEUS_TEXT_ESCAPE_HH__
+
+#include "util/string_view.hh"
+
+#include <string>
+
+namespace prometheus {
+
+  // Escaping of help texts and label values for the text format,
+  // appending to out. Strings are escaped byte by byte, and bytes
+  // other than backslashes, newlines and (in label values) double
+  // quotes are copied as they are, so UTF-8 is preserved. See also
+  // escape_help() and escape_label_value() in output_formatter.hh.
+  void append_escaped_help(std::string* out, util::string_view s);
+  // Label values are quoted.
+  void append_escaped_label_value(std::string* out, util::string_view s);
+  // Appends name="value", with value escaped as above.
+  void append_text_label(std::string* out, util::string_view name,
+                         util::string_view value);
+
+  namespace impl {
+
+    // Returns a pointer to the first backslash, newline or, if quote
+    // is true, double quote in [begin, end), or end if there is none.
+    // This is vectorized with SSE2 where available, and falls back to
+    // find_escaped_char_swar() otherwise.
+    const char* find_escaped_char(const char* begin, const char* end,
+                                  bool quote);
+    // Same as above, comparing 8 bytes at a time in a 64-bit integer
+    // on all platforms.
+    const char* find_escaped_char_swar(const char* begin, const char* end,
+                                       bool quote);
+
+  } /* namespace impl */
+} /* namespace prometheus */
+
+#endif
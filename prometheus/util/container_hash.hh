@@ -1,27 +1,28 @@
 #ifndef PROMETHEUS_ARRAYHASH_HH__
 #define PROMETHEUS_ARRAYHASH_HH__
 
-#include <functional>
-#include <type_traits>
+#include "hash.hh"
+#include "string_view.hh"
+
+#include <cstddef>
 
 namespace prometheus {
   namespace util {
 
-    template <class Container, template <class> class ItemHash = std::hash>
+    // Hashes a container of strings (or of anything convertible to a
+    // string_view) as the sequence of its strings, see Hasher.
+    template <class Container>
     struct ContainerHash {
       typedef Container argument_type;
-      typedef typename std::remove_reference<
-          decltype(*Container().begin())>::type value_type;
-      typedef std::hash<value_type> hash_type;
-      typedef typename hash_type::result_type result_type;
+      typedef std::size_t result_type;
 
-      result_type operator()(const Container &container) const {
-        hash_type hasher;
-        result_type hash = 0;
+      result_type operator()(const Container &container) const noexcept {
+        Hasher hasher;
         for (const auto &it : container) {
-          hash = hasher(it) ^ hash << 1;
+          string_view s(it);
+          hasher.add(s.data(), s.size());
         }
-        return hash;
+        return static_cast<result_type>(hasher.finish());
       }
     };
 
@@ -0,0 +1,75 @@
+#ifndef PROMETHEUS_UTIL_HASH_HH__
+#define PROMETHEUS_UTIL_HASH_HH__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace prometheus {
+  namespace util {
+
+    class Hasher {
+      // A 64-bit hash over a sequence of strings, with the mixing
+      // steps of MurmurHash64A. Each string is prefixed with its
+      // length, so that {"ab", "c"} and {"a", "bc"} hash differently,
+      // and strings are read 8 bytes at a time. Every input word goes
+      // through a full multiply-xorshift mix, so permuted or shifted
+      // sequences don't cancel out like with XOR-based combinations.
+     public:
+      Hasher() : hash_(0x9e3779b97f4a7c15ULL) {}
+
+      void add(const char* data, std::size_t size) {
+        mix(size);
+        while (size >= 8) {
+          uint64_t word;
+          std::memcpy(&word, data, 8);
+          mix(word);
+          data += 8;
+          size -= 8;
+        }
+        if (size > 0) {
+          mix(read_tail(data, size));
+        }
+      }
+
+      uint64_t finish() const {
+        uint64_t h = hash_;
+        h ^= h >> kShift;
+        h *= kMultiplier;
+        h ^= h >> kShift;
+        return h;
+      }
+
+     private:
+      static const uint64_t kMultiplier = 0xc6a4a7935bd1e995ULL;
+      static const int kShift = 47;
+
+      void mix(uint64_t k) {
+        k *= kMultiplier;
+        k ^= k >> kShift;
+        k *= kMultiplier;
+        hash_ ^= k;
+        hash_ *= kMultiplier;
+      }
+
+      // Packs the last 1 to 7 bytes of a string in a word. Together
+      // with the length, the word determines the bytes.
+      static uint64_t read_tail(const char* data, std::size_t size) {
+        if (size >= 4) {
+          uint32_t first, last;
+          std::memcpy(&first, data, 4);
+          std::memcpy(&last, data + size - 4, 4);
+          return (uint64_t(first) << 32) | last;
+        }
+        return (uint64_t(static_cast<unsigned char>(data[0])) << 16) |
+               (uint64_t(static_cast<unsigned char>(data[size / 2])) << 8) |
+               uint64_t(static_cast<unsigned char>(data[size - 1]));
+      }
+
+      uint64_t hash_;
+    };
+
+  } /* namespace util */
+} /* namespace prometheus */
+
+#endif /* PROMETHEUS_UTIL_HASH_HH__ */
@@ -0,0 +1,73 @@
+#ifndef PROMETHEUS_UTIL_LABEL_VALUE_HH__
+#define PROMETHEUS_UTIL_LABEL_VALUE_HH__
+
+#include "string_view.hh"
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <type_traits>
+
+namespace prometheus {
+  namespace util {
+
+    class LabelValue {
+      // A label value passed to LabeledMetric::labels(). Strings are
+      // referenced without being copied, and integers are formatted
+      // in an inline buffer, so that looking up an existing child
+      // doesn't allocate. A LabelValue must not outlive the string
+      // it was built from; it is meant to be a temporary argument.
+     public:
+      LabelValue(const char* s) : view_(s) {}
+      LabelValue(std::string const& s) : view_(s) {}
+      LabelValue(string_view s) : view_(s) {}
+
+      template <typename T,
+                typename = typename std::enable_if<
+                    std::is_integral<T>::value &&
+                    !std::is_same<T, bool>::value &&
+                    !std::is_same<T, char>::value>::type>
+      LabelValue(T v) {
+        char* end = buffer_ + sizeof(buffer_);
+        char* p = end;
+        bool negative = v < 0;
+        do {
+          // Dividing a negative number rounds towards 0, so each
+          // remainder is in [-9, 0].
+          int digit = static_cast<int>(v % 10);
+          *--p = static_cast<char>('0' + (negative ? -digit : digit));
+          v /= 10;
+        } while (v != 0);
+        if (negative) {
+          *--p = '-';
+        }
+        view_ = string_view(p, end - p);
+      }
+
+      LabelValue(LabelValue const& rhs) : view_(rhs.view_) {
+        if (rhs.in_buffer()) {
+          std::copy(rhs.buffer_, rhs.buffer_ + sizeof(buffer_), buffer_);
+          view_ = string_view(buffer_ + (rhs.view_.data() - rhs.buffer_),
+                              rhs.view_.size());
+        }
+      }
+      LabelValue& operator=(LabelValue const&) = delete;
+
+      string_view view() const { return view_; }
+
+     private:
+      bool in_buffer() const {
+        std::less<const char*> less;
+        return !less(view_.data(), buffer_) &&
+               less(view_.data(), buffer_ + sizeof(buffer_));
+      }
+
+      string_view view_;
+      // Large enough for any 64-bit integer with its sign.
+      char buffer_[20];
+    };
+
+  } /* namespace util */
+} /* namespace prometheus */
+
+#endif /* PROMETHEUS_UTIL_LABEL_VALUE_HH__ */
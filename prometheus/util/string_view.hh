@@ -0,0 +1,72 @@
+#ifndef PROMETHEUS_UTIL_STRING_VIEW_HH__
+#define PROMETHEUS_UTIL_STRING_VIEW_HH__
+
+#include "hash.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+
+namespace prometheus {
+  namespace util {
+
+    class string_view {
+      // A non-owning reference to a sequence of characters, like the
+      // C++17 std::string_view, which isn't available in C++14. Only
+      // what the library needs is provided.
+     public:
+      typedef const char* const_iterator;
+
+      constexpr string_view() noexcept : data_(nullptr), size_(0) {}
+      constexpr string_view(const char* data, std::size_t size) noexcept
+          : data_(data), size_(size) {}
+      string_view(const char* s) : data_(s), size_(std::strlen(s)) {}
+      string_view(std::string const& s) noexcept
+          : data_(s.data()), size_(s.size()) {}
+
+      constexpr const char* data() const noexcept { return data_; }
+      constexpr std::size_t size() const noexcept { return size_; }
+      constexpr bool empty() const noexcept { return size_ == 0; }
+      constexpr const_iterator begin() const noexcept { return data_; }
+      constexpr const_iterator end() const noexcept { return data_ + size_; }
+      constexpr char operator[](std::size_t i) const { return data_[i]; }
+
+      std::string to_string() const { return std::string(data_, size_); }
+
+     private:
+      const char* data_;
+      std::size_t size_;
+    };
+
+    inline bool operator==(string_view lhs, string_view rhs) noexcept {
+      // Views on the same characters (e.g. on the same interned
+      // string) are equal without looking at the characters.
+      return lhs.size() == rhs.size() &&
+             (lhs.data() == rhs.data() || lhs.size() == 0 ||
+              std::memcmp(lhs.data(), rhs.data(), lhs.size()) == 0);
+    }
+
+    inline bool operator!=(string_view lhs, string_view rhs) noexcept {
+      return !(lhs == rhs);
+    }
+
+  } /* namespace util */
+} /* namespace prometheus */
+
+namespace std {
+  template <>
+  struct hash<::prometheus::util::string_view> {
+    typedef ::prometheus::util::string_view argument_type;
+    typedef std::size_t result_type;
+
+    std::size_t operator()(::prometheus::util::string_view s) const noexcept {
+      ::prometheus::util::Hasher hasher;
+      hasher.add(s.data(), s.size());
+      return static_cast<std::size_t>(hasher.finish());
+    }
+  };
+} /* namespace std */
+
+#endif /* PROMETHEUS_UTIL_STRING_VIEW_HH__ */
@@ -1,11 +1,15 @@
+#include "bucket_search.hh"
 #include "exceptions.hh"
 #include "values.hh"
-#include "prometheus/proto/metrics.pb.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <stdexcept>
 #include <limits>
-#include <mutex>
+#include <new>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -21,6 +25,13 @@ namespace prometheus {
       histogram_levels({.005, .01, .025, .05, .075, .1, .25, .5, .75, 1.0, 2.5,
                         5.0, 7.5, 10.0, kInf});
 
+  const std::vector<double> default_summary_quantiles =
+      summary_quantiles({0.5, 0.9, 0.99});
+
+  std::vector<double> summary_quantiles(std::vector<double>&& v) {
+    return std::move(v);
+  }
+
   std::vector<double> histogram_levels_powers_of(double base, int count,
 						 double starting_exponent) {
     std::vector<double> v(count + 2);
@@ -60,18 +71,10 @@ namespace prometheus {
 
   namespace impl {
 
-    using ::prometheus::client::Bucket;
-    using ::prometheus::client::Histogram;
-    using ::prometheus::client::Metric;
-    using ::prometheus::client::MetricFamily;
-
-    void BaseGaugeValue::collect_value(Metric* m) const {
-      m->mutable_gauge()->set_value(value_);
+    void BaseGaugeValue::collect_value(MetricSink* sink) const {
+      sink->value(value_);
     }
 
-    /* static */ void BaseGaugeValue::set_metricfamily_type(MetricFamily* mf) {
-      mf->set_type(::prometheus::client::MetricType::GAUGE);
-    }
 
     void IncDecGaugeValue::inc(double value) {
       double current = value_.load();
@@ -90,16 +93,109 @@ namespace prometheus {
         ;
     }
 
-    void CounterValue::collect_value(Metric* m) const {
-      m->mutable_counter()->set_value(value_);
+    void CounterValue::collect_value(MetricSink* sink) const {
+      sink->value(value_);
     }
 
-    /* static */ void CounterValue::set_metricfamily_type(MetricFamily* mf) {
-      mf->set_type(::prometheus::client::MetricType::COUNTER);
+
+    namespace {
+      // Each thread gets a small sequential index the first time it
+      // touches a sharded value. Threads are spread evenly over the
+      // cells this way, as long as there are fewer threads than cells.
+      std::atomic<unsigned> next_thread_index(0);
+
+      unsigned current_thread_index() {
+        static thread_local unsigned index =
+            next_thread_index.fetch_add(1, std::memory_order_relaxed);
+        return index;
+      }
+    } /* namespace */
+
+    /* static */ unsigned ShardedCounterValue::cell_count() {
+      static const unsigned count = [] {
+        unsigned threads = std::thread::hardware_concurrency();
+        unsigned c = 1;
+        while (c < threads && c < kMaxCells) {
+          c <<= 1;
+        }
+        return c;
+      }();
+      return count;
     }
 
-    HistogramValue::HistogramValue(std::vector<double> const& levels)
-        : levels_(add_inf(levels)), values_(levels_.size()) {
+    ShardedCounterValue::ShardedCounterValue()
+        : buffer_(new char[(cell_count() + 1) * sizeof(Cell)]) {
+      static_assert(sizeof(Cell) == kCacheLineSize,
+                    "A Cell must fill exactly one cache line.");
+      uintptr_t p = reinterpret_cast<uintptr_t>(buffer_.get());
+      p = (p + kCacheLineSize - 1) & ~uintptr_t(kCacheLineSize - 1);
+      cells_ = reinterpret_cast<Cell*>(p);
+      for (unsigned i = 0; i < cell_count(); ++i) {
+        new (&cells_[i]) Cell;
+        cells_[i].value.store(0.0, std::memory_order_relaxed);
+      }
+    }
+
+    ShardedCounterValue::ShardedCounterValue(ShardedCounterValue const& rhs)
+        : ShardedCounterValue() {
+      cells_[0].value.store(rhs.value(), std::memory_order_relaxed);
+    }
+
+    ShardedCounterValue::~ShardedCounterValue() {}
+
+    ShardedCounterValue::Cell& ShardedCounterValue::cell_for_current_thread() {
+      return cells_[current_thread_index() & (cell_count() - 1)];
+    }
+
+    void ShardedCounterValue::inc(double value) {
+      if (value < 0) {
+        throw err::NegativeCounterIncrementException();
+      }
+      std::atomic<double>& cell = cell_for_current_thread().value;
+      double current = cell.load(std::memory_order_relaxed);
+      while (!(cell.compare_exchange_weak(current, current + value,
+                                          std::memory_order_relaxed)))
+        ;
+    }
+
+    double ShardedCounterValue::value() const {
+      double sum = 0;
+      for (unsigned i = 0; i < cell_count(); ++i) {
+        sum += cells_[i].value.load(std::memory_order_relaxed);
+      }
+      return sum;
+    }
+
+    void ShardedCounterValue::collect_value(MetricSink* sink) const {
+      sink->value(value());
+    }
+
+
+    namespace {
+      // Returns the exponent e of the smallest power of two such that
+      // v <= 2**e, for a normal positive v. Infinity returns 1024.
+      int ceil_log2(double v) {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        int exponent = int((bits >> 52) & 0x7ff) - 1023;
+        uint64_t mantissa = bits & ((uint64_t(1) << 52) - 1);
+        return mantissa == 0 ? exponent : exponent + 1;
+      }
+
+      // Returns true if v is a normal positive power of two.
+      bool is_normal_power_of_two(double v) {
+        return std::isnormal(v) && v > 0 && v == std::ldexp(1.0, ceil_log2(v));
+      }
+    } /* namespace */
+
+    HistogramLayout::HistogramLayout(std::vector<double> const& levels)
+        : levels_(HistogramValue::add_inf(levels)),
+          search_(best_bucket_search()),
+          kind_(kSearch),
+          first_level_(0),
+          increment_(0),
+          first_power_index_(0),
+          first_exponent_(0) {
       double last_level = std::numeric_limits<double>::lowest();
       for (auto const& l : levels) {
         if (l <= last_level) {
@@ -107,10 +203,98 @@ namespace prometheus {
         }
         last_level = l;
       }
+
+      // Finite levels are levels_[0, n).
+      const std::size_t n = levels_.size() - 1;
+      if (n < 2) {
+        return;
+      }
+
+      // Evenly spaced levels. Levels built by repeated additions may
+      // be off by a few ulps, which linear_index() corrects.
+      first_level_ = levels_[0];
+      increment_ = (levels_[n - 1] - levels_[0]) / (n - 1);
+      bool linear = std::isfinite(increment_) && increment_ > 0;
+      for (std::size_t i = 0; linear && i < n; ++i) {
+        linear = std::fabs(levels_[i] - (first_level_ + i * increment_)) <=
+                 increment_ * 1e-6;
+      }
+      if (linear) {
+        kind_ = kLinear;
+        return;
+      }
+
+      // Consecutive powers of two, optionally preceded by one level
+      // (histogram_levels_powers_of starts with 0).
+      first_power_index_ = is_normal_power_of_two(levels_[0]) ? 0 : 1;
+      bool powers = n - first_power_index_ >= 2;
+      for (std::size_t i = first_power_index_; powers && i < n; ++i) {
+        powers = is_normal_power_of_two(levels_[i]) &&
+                 (i == first_power_index_ ||
+                  ceil_log2(levels_[i]) == ceil_log2(levels_[i - 1]) + 1);
+      }
+      if (powers) {
+        kind_ = kPowersOfTwo;
+        first_exponent_ = ceil_log2(levels_[first_power_index_]);
+      }
+    }
+
+    std::size_t HistogramLayout::bucket_index(double v) const {
+      switch (kind_) {
+        case kLinear:
+          return linear_index(v);
+        case kPowersOfTwo:
+          return powers_of_two_index(v);
+        default:
+          return search_(levels_.data(), levels_.size() - 1, v);
+      }
+    }
+
+    std::size_t HistogramLayout::linear_index(double v) const {
+      const std::size_t n = levels_.size() - 1;
+      if (std::isnan(v)) {
+        return n;
+      }
+      double guess = std::ceil((v - first_level_) / increment_);
+      std::size_t i = guess <= 0 ? 0 : guess >= n ? n : std::size_t(guess);
+      // Correct rounding errors so the result is exact.
+      while (i > 0 && v <= levels_[i - 1]) {
+        --i;
+      }
+      while (i < n && v > levels_[i]) {
+        ++i;
+      }
+      return i;
+    }
+
+    std::size_t HistogramLayout::powers_of_two_index(double v) const {
+      const std::size_t n = levels_.size() - 1;
+      if (std::isnan(v)) {
+        return n;
+      }
+      if (v <= levels_[first_power_index_]) {
+        return (first_power_index_ == 1 && !(v <= levels_[0])) ? 1 : 0;
+      }
+      // v > 2**first_exponent_, so v is a normal positive number or
+      // +Inf.
+      std::size_t i =
+          first_power_index_ + std::size_t(ceil_log2(v) - first_exponent_);
+      return i < n ? i : n;
+    }
+
+    HistogramValue::HistogramValue(std::vector<double> const& levels)
+        : HistogramValue(std::make_shared<const HistogramLayout>(levels)) {}
+
+    HistogramValue::HistogramValue(
+        std::shared_ptr<const HistogramLayout> const& layout)
+        : layout_(layout),
+          counts_(new std::atomic<uint64_t>[layout_->size()]),
+          samples_sum_(0) {
+      reset_counts();
     }
 
     HistogramValue::HistogramValue(HistogramValue const& rhs)
-        : levels_(rhs.levels_), values_(rhs.levels_.size()) {}
+        : HistogramValue(rhs.layout_) {}
 
     HistogramValue::~HistogramValue() {}
 
@@ -130,57 +314,760 @@ namespace prometheus {
       }
     }
 
+    void HistogramValue::reset_counts() {
+      for (std::size_t i = 0; i < layout_->size(); ++i) {
+        counts_[i].store(0, std::memory_order_relaxed);
+      }
+    }
+
     void HistogramValue::observe(double v) {
-      auto lvl_it = levels_.begin();
-      auto v_it = values_.begin();
-      {
-        std::lock_guard<std::mutex> l(mutex_);
-        while (lvl_it != levels_.end()) {
-          if (v <= *lvl_it) {
-            *v_it += 1;
+      counts_[layout_->bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+      double current = samples_sum_.load(std::memory_order_relaxed);
+      while (!(samples_sum_.compare_exchange_weak(current, current + v,
+                                                  std::memory_order_relaxed)))
+        ;
+    }
+
+    double HistogramValue::value(double d) const {
+      std::size_t last = layout_->bucket_index(d);
+      uint64_t count = 0;
+      for (std::size_t i = 0; i <= last; ++i) {
+        count += counts_[i].load(std::memory_order_relaxed);
+      }
+      return count;
+    }
+
+    void HistogramValue::collect_value(MetricSink* sink) const {
+      std::vector<double> const& levels = layout_->levels();
+      uint64_t cumulative_count = 0;
+      for (std::size_t i = 0; i < levels.size(); ++i) {
+        cumulative_count += counts_[i].load(std::memory_order_relaxed);
+        sink->bucket(levels[i], cumulative_count);
+      }
+      sink->histogram(cumulative_count,
+                      samples_sum_.load(std::memory_order_relaxed));
+    }
+
+
+    namespace {
+      // Ids of live ThreadCells are kept small and dense by reusing
+      // the ids of destroyed ones, since every thread has a table
+      // indexed by them.
+      std::mutex thread_cells_ids_mutex;
+      std::vector<std::size_t> free_thread_cells_ids;
+      std::size_t next_thread_cells_id = 0;
+      std::atomic<uint64_t> next_thread_cells_serial(1);
+
+      std::size_t allocate_thread_cells_id() {
+        std::lock_guard<std::mutex> l(thread_cells_ids_mutex);
+        if (free_thread_cells_ids.empty()) {
+          return next_thread_cells_id++;
+        }
+        std::size_t id = free_thread_cells_ids.back();
+        free_thread_cells_ids.pop_back();
+        return id;
+      }
+
+      void release_thread_cells_id(std::size_t id) {
+        std::lock_guard<std::mutex> l(thread_cells_ids_mutex);
+        free_thread_cells_ids.push_back(id);
+      }
+
+      // A copy of the current thread's slot table pointer and size.
+      // Unlike ThreadSlots, these are trivially constructible and
+      // destructible, so reading them doesn't need the
+      // initialization check of a thread_local object with a
+      // destructor.
+      thread_local void const* thread_slots_data = nullptr;
+      thread_local std::size_t thread_slots_size = 0;
+      // Set once the current thread's ThreadSlots is destroyed. The
+      // destructors of other thread_local objects may still update
+      // batched values after that, and must not touch the table.
+      // Trivially destructible, so it stays readable until the thread
+      // is gone.
+      thread_local bool thread_slots_destroyed = false;
+
+      // Adds to a cell that is only written by the current thread.
+      template <typename T>
+      void add_to_cell(std::atomic<T>& cell, T value) {
+        cell.store(cell.load(std::memory_order_relaxed) + value,
+                   std::memory_order_relaxed);
+      }
+    } /* namespace */
+
+    struct ThreadCells::Slot {
+      uint64_t serial = 0;
+      std::shared_ptr<void> cell;
+      std::weak_ptr<ThreadCells> owner;
+    };
+
+    struct ThreadCells::ThreadSlots {
+      std::vector<Slot> slots;
+
+      ~ThreadSlots() {
+        thread_slots_size = 0;
+        thread_slots_destroyed = true;
+        for (Slot& s : slots) {
+          if (std::shared_ptr<ThreadCells> owner = s.owner.lock()) {
+            owner->retire(s.cell);
           }
-          ++lvl_it;
-          ++v_it;
         }
-        samples_sum_ += v;
       }
+    };
+
+    /* static */ ThreadCells::ThreadSlots& ThreadCells::thread_slots() {
+      static thread_local ThreadSlots slots;
+      return slots;
     }
 
-    double HistogramValue::value(double d) const {
-      auto lvl_it = levels_.begin();
-      auto v_it = values_.begin();
+    ThreadCells::ThreadCells()
+        : id_(allocate_thread_cells_id()),
+          serial_(next_thread_cells_serial.fetch_add(
+              1, std::memory_order_relaxed)) {}
+
+    ThreadCells::~ThreadCells() { release_thread_cells_id(id_); }
+
+    void* ThreadCells::find_cell() const {
+      if (id_ < thread_slots_size) {
+        Slot const& s = static_cast<Slot const*>(thread_slots_data)[id_];
+        if (s.serial == serial_) {
+          return s.cell.get();
+        }
+      }
+      return nullptr;
+    }
+
+    void* ThreadCells::add_cell(std::shared_ptr<void> const& cell) {
+      if (thread_slots_destroyed) {
+        return nullptr;
+      }
       {
         std::lock_guard<std::mutex> l(mutex_);
-        while (lvl_it != levels_.end()) {
-          if (d <= *lvl_it) {
-            return *v_it;
+        cells_.push_back(cell);
+      }
+      std::vector<Slot>& slots = thread_slots().slots;
+      if (id_ >= slots.size()) {
+        slots.resize(id_ + 1);
+        thread_slots_data = slots.data();
+        thread_slots_size = slots.size();
+      }
+      Slot& s = slots[id_];
+      s.serial = serial_;
+      s.cell = cell;
+      s.owner = shared_from_this();
+      return cell.get();
+    }
+
+    void ThreadCells::retire(std::shared_ptr<void> const& cell) {
+      std::lock_guard<std::mutex> l(mutex_);
+      retire_cell(cell.get());
+      cells_.erase(std::find(cells_.begin(), cells_.end(), cell));
+    }
+
+    class BatchedCounterValue::Cells : public ThreadCells {
+     public:
+      explicit Cells(double retired) : retired_(retired) {}
+
+      // Returns the cell of the current thread, or nullptr if it
+      // can't have one (see ThreadCells::add_cell()).
+      std::atomic<double>* local() {
+        void* cell = find_cell();
+        if (cell == nullptr) {
+          cell = add_cell(std::make_shared<std::atomic<double>>(0));
+        }
+        return static_cast<std::atomic<double>*>(cell);
+      }
+
+      // Adds an increment of a thread without a cell.
+      void add_retired(double value) {
+        std::lock_guard<std::mutex> l(mutex_);
+        retired_ += value;
+      }
+
+      double value() const {
+        std::lock_guard<std::mutex> l(mutex_);
+        double sum = retired_;
+        for (auto const& cell : cells_) {
+          sum += static_cast<std::atomic<double> const*>(cell.get())->load(
+              std::memory_order_relaxed);
+        }
+        return sum;
+      }
+
+     private:
+      void retire_cell(void const* cell) override {
+        retired_ += static_cast<std::atomic<double> const*>(cell)->load(
+            std::memory_order_relaxed);
+      }
+
+      // The increments of threads that exited.
+      double retired_;
+    };
+
+    BatchedCounterValue::BatchedCounterValue()
+        : cells_(std::make_shared<Cells>(0)) {}
+
+    BatchedCounterValue::BatchedCounterValue(BatchedCounterValue const& rhs)
+        : cells_(std::make_shared<Cells>(rhs.value())) {}
+
+    BatchedCounterValue::~BatchedCounterValue() {}
+
+    void BatchedCounterValue::inc(double value) {
+      if (value < 0) {
+        throw err::NegativeCounterIncrementException();
+      }
+      std::atomic<double>* cell = cells_->local();
+      if (cell) {
+        add_to_cell(*cell, value);
+      } else {
+        cells_->add_retired(value);
+      }
+    }
+
+    double BatchedCounterValue::value() const { return cells_->value(); }
+
+    void BatchedCounterValue::collect_value(MetricSink* sink) const {
+      sink->value(value());
+    }
+
+
+    class BatchedHistogramValue::Cells : public ThreadCells {
+     public:
+      struct Cell {
+        explicit Cell(std::size_t size)
+            : counts(new std::atomic<uint64_t>[size]), sum(0) {
+          for (std::size_t i = 0; i < size; ++i) {
+            counts[i].store(0, std::memory_order_relaxed);
           }
-          ++lvl_it;
-          ++v_it;
         }
-        return values_.back();
+        std::unique_ptr<std::atomic<uint64_t>[]> counts;
+        std::atomic<double> sum;
+      };
+
+      explicit Cells(std::shared_ptr<const HistogramLayout> const& layout)
+          : layout_(layout), retired_counts_(layout->size()), retired_sum_(0) {}
+
+      std::shared_ptr<const HistogramLayout> const& layout() const {
+        return layout_;
+      }
+
+      // Returns the cell of the current thread, or nullptr if it
+      // can't have one (see ThreadCells::add_cell()).
+      Cell* local() {
+        void* cell = find_cell();
+        if (cell == nullptr) {
+          cell = add_cell(std::make_shared<Cell>(layout_->size()));
+        }
+        return static_cast<Cell*>(cell);
+      }
+
+      // Adds an observation of a thread without a cell.
+      void add_retired(std::size_t bucket, double v) {
+        std::lock_guard<std::mutex> l(mutex_);
+        ++retired_counts_[bucket];
+        retired_sum_ += v;
+      }
+
+      // Merges all cells into non-cumulative counts and a sum.
+      void merge(std::vector<uint64_t>* counts, double* sum) const {
+        std::lock_guard<std::mutex> l(mutex_);
+        *counts = retired_counts_;
+        *sum = retired_sum_;
+        for (auto const& c : cells_) {
+          Cell const* cell = static_cast<Cell const*>(c.get());
+          for (std::size_t i = 0; i < counts->size(); ++i) {
+            (*counts)[i] += cell->counts[i].load(std::memory_order_relaxed);
+          }
+          *sum += cell->sum.load(std::memory_order_relaxed);
+        }
+      }
+
+     private:
+      void retire_cell(void const* c) override {
+        Cell const* cell = static_cast<Cell const*>(c);
+        for (std::size_t i = 0; i < retired_counts_.size(); ++i) {
+          retired_counts_[i] += cell->counts[i].load(std::memory_order_relaxed);
+        }
+        retired_sum_ += cell->sum.load(std::memory_order_relaxed);
+      }
+
+      const std::shared_ptr<const HistogramLayout> layout_;
+      // The observations of threads that exited.
+      std::vector<uint64_t> retired_counts_;
+      double retired_sum_;
+    };
+
+    BatchedHistogramValue::BatchedHistogramValue(
+        std::vector<double> const& levels)
+        : cells_(std::make_shared<Cells>(
+              std::make_shared<const HistogramLayout>(levels))) {}
+
+    BatchedHistogramValue::BatchedHistogramValue(
+        BatchedHistogramValue const& rhs)
+        : cells_(std::make_shared<Cells>(rhs.layout())) {}
+
+    BatchedHistogramValue::~BatchedHistogramValue() {}
+
+    std::shared_ptr<const HistogramLayout> const&
+    BatchedHistogramValue::layout() const {
+      return cells_->layout();
+    }
+
+    void BatchedHistogramValue::observe(double v) {
+      std::size_t bucket = cells_->layout()->bucket_index(v);
+      Cells::Cell* cell = cells_->local();
+      if (cell) {
+        add_to_cell(cell->counts[bucket], uint64_t(1));
+        add_to_cell(cell->sum, v);
+      } else {
+        cells_->add_retired(bucket, v);
+      }
+    }
+
+    double BatchedHistogramValue::value(double d) const {
+      std::vector<uint64_t> counts;
+      double sum;
+      cells_->merge(&counts, &sum);
+      std::size_t last = layout()->bucket_index(d);
+      uint64_t count = 0;
+      for (std::size_t i = 0; i <= last; ++i) {
+        count += counts[i];
+      }
+      return count;
+    }
+
+    void BatchedHistogramValue::collect_value(MetricSink* sink) const {
+      std::vector<uint64_t> counts;
+      double sum;
+      cells_->merge(&counts, &sum);
+      std::vector<double> const& levels = layout()->levels();
+      uint64_t cumulative_count = 0;
+      for (std::size_t i = 0; i < levels.size(); ++i) {
+        cumulative_count += counts[i];
+        sink->bucket(levels[i], cumulative_count);
+      }
+      sink->histogram(cumulative_count, sum);
+    }
+
+
+    namespace {
+      // For each positive schema s, the 2**s bounds that split the
+      // mantissa range [0.5, 1) of a double into buckets:
+      // bounds[j] = 2**(j/2**s - 1).
+      std::vector<double> const& sparse_histogram_bounds(int schema) {
+        static const std::vector<std::vector<double>> bounds = [] {
+          std::vector<std::vector<double>> b(
+              SparseHistogramValue::kMaxSchema + 1);
+          for (int s = 1; s <= SparseHistogramValue::kMaxSchema; ++s) {
+            int n = 1 << s;
+            for (int j = 0; j < n; ++j) {
+              b[s].push_back(std::exp2(double(j) / n) / 2);
+            }
+          }
+          return b;
+        }();
+        return bounds[schema];
+      }
+    } /* namespace */
+
+    SparseHistogramValue::SparseHistogramValue(int schema,
+                                               std::size_t max_buckets,
+                                               double zero_threshold)
+        : max_buckets_(max_buckets),
+          zero_threshold_(zero_threshold),
+          schema_(schema),
+          zero_count_(0),
+          count_(0),
+          sum_(0) {
+      if (schema < kMinSchema || schema > kMaxSchema) {
+        throw std::logic_error("invalid sparse histogram schema");
+      }
+      if (max_buckets == 0) {
+        throw std::logic_error("max_buckets must be positive");
+      }
+      if (!(zero_threshold >= 0)) {
+        throw std::logic_error("zero_threshold can't be negative");
       }
     }
 
-    void HistogramValue::collect_value(Metric* m) const {
-      Histogram* h = m->mutable_histogram();
-      auto it = values_.begin();
+    SparseHistogramValue::SparseHistogramValue(SparseHistogramValue const& rhs)
+        : SparseHistogramValue(rhs.schema(), rhs.max_buckets_,
+                               rhs.zero_threshold_) {}
+
+    SparseHistogramValue::~SparseHistogramValue() {}
+
+    /* static */ int SparseHistogramValue::bucket_index(double v, int s) {
+      if (std::isinf(v)) {
+        v = std::numeric_limits<double>::max();
+      }
+      int exp;
+      double frac = std::frexp(v, &exp);
+      if (s > 0) {
+        std::vector<double> const& bounds = sparse_histogram_bounds(s);
+        int j = std::lower_bound(bounds.begin(), bounds.end(), frac) -
+                bounds.begin();
+        return j + (exp - 1) * int(bounds.size());
+      }
+      // Without sub-buckets, the index is the exponent of the
+      // smallest power of two >= v, divided by 2**-s, rounded up.
+      int key = frac == 0.5 ? exp - 1 : exp;
+      int div = 1 << -s;
+      return key > 0 ? (key + div - 1) / div : -((-key) / div);
+    }
+
+    /* static */ double SparseHistogramValue::bucket_upper_bound(int i,
+                                                                int s) {
+      if (s > 0) {
+        int n = 1 << s;
+        int exp = i >= 0 ? i / n : -((-i + n - 1) / n);
+        return std::ldexp(std::exp2(double(i - exp * n) / n), exp);
+      }
+      return std::ldexp(1.0, i * (1 << -s));
+    }
+
+    void SparseHistogramValue::observe(double v) {
+      // Negative bucket i holds values in (-base**i, -base**(i-1)], so
+      // that its bound -base**(i-1) in collect_value() is inclusive
+      // like "le": a magnitude is counted in the bucket of the next
+      // larger double.
+      auto index_of = [v](int schema) {
+        return v > 0 ? bucket_index(v, schema)
+                     : bucket_index(std::nextafter(-v, kInf), schema);
+      };
+      bool zero = std::fabs(v) <= zero_threshold_;
+      bool nan = std::isnan(v);
+      int schema = schema_.load(std::memory_order_relaxed);
+      int index = (zero || nan) ? 0 : index_of(schema);
+
+      std::lock_guard<std::mutex> l(mutex_);
+      ++count_;
+      sum_ += v;
+      if (nan) {
+        return;
+      }
+      if (zero) {
+        ++zero_count_;
+        return;
+      }
+      if (schema != schema_.load(std::memory_order_relaxed)) {
+        // The resolution was reduced since we computed the index.
+        schema = schema_.load(std::memory_order_relaxed);
+        index = index_of(schema);
+      }
+      auto& buckets = v > 0 ? positive_ : negative_;
+      ++buckets[index];
+      if (positive_.size() + negative_.size() > max_buckets_) {
+        reduce_resolution();
+      }
+    }
+
+    void SparseHistogramValue::reduce_resolution() {
+      int schema = schema_.load(std::memory_order_relaxed);
+      while (positive_.size() + negative_.size() > max_buckets_ &&
+             schema > kMinSchema) {
+        --schema;
+        // Bucket i of schema s covers buckets 2i-1 and 2i of schema
+        // s+1, so buckets are merged into bucket ceil(i/2).
+        for (auto* buckets : {&positive_, &negative_}) {
+          std::unordered_map<int, uint64_t> merged;
+          for (auto const& b : *buckets) {
+            int i = b.first;
+            merged[i >= 0 ? (i + 1) / 2 : -(-i / 2)] += b.second;
+          }
+          buckets->swap(merged);
+        }
+      }
+      schema_.store(schema, std::memory_order_relaxed);
+    }
+
+    double SparseHistogramValue::value() const {
+      std::lock_guard<std::mutex> l(mutex_);
+      return count_;
+    }
+
+    int SparseHistogramValue::schema() const {
+      return schema_.load(std::memory_order_relaxed);
+    }
+
+    std::size_t SparseHistogramValue::bucket_count() const {
+      std::lock_guard<std::mutex> l(mutex_);
+      return positive_.size() + negative_.size();
+    }
+
+    void SparseHistogramValue::collect_value(MetricSink* sink) const {
+      std::vector<std::pair<int, uint64_t>> positive, negative;
+      uint64_t zero_count, count;
+      double sum;
+      int schema;
       {
         std::lock_guard<std::mutex> l(mutex_);
-        h->set_sample_count(values_.back());
-        h->set_sample_sum(samples_sum_);
-        for (auto const& l : levels_) {
-          Bucket* b = h->add_bucket();
-          b->set_upper_bound(l);
-          b->set_cumulative_count(*it);
-          ++it;
+        positive.assign(positive_.begin(), positive_.end());
+        negative.assign(negative_.begin(), negative_.end());
+        zero_count = zero_count_;
+        count = count_;
+        sum = sum_;
+        schema = schema_.load(std::memory_order_relaxed);
+      }
+      std::sort(positive.begin(), positive.end());
+      std::sort(negative.begin(), negative.end());
+
+      uint64_t cumulative_count = 0;
+      auto add_bucket = [&](double upper_bound, uint64_t n) {
+        cumulative_count += n;
+        sink->bucket(upper_bound, cumulative_count);
+      };
+      // Negative bucket i holds values in (-base**i, -base**(i-1)],
+      // so going up from the most negative values means going down
+      // the indexes.
+      for (auto it = negative.rbegin(); it != negative.rend(); ++it) {
+        add_bucket(-bucket_upper_bound(it->first - 1, schema), it->second);
+      }
+      if (zero_count > 0) {
+        add_bucket(zero_threshold_, zero_count);
+      }
+      for (auto const& b : positive) {
+        add_bucket(bucket_upper_bound(b.first, schema), b.second);
+      }
+      add_bucket(kInf, count - cumulative_count);
+      sink->histogram(count, sum);
+    }
+
+
+    namespace {
+      // SummaryValueBase tracks magnitudes in [2**kMinExponent,
+      // 2**(kMinExponent + kOctaves)) for each sign.
+      const int kMinExponent = -64;
+      const int kOctaves = 128;
+      const int kSubBucketBits = 5;
+      static_assert(SummaryValueBase::kSubBuckets == 1 << kSubBucketBits,
+                    "kSubBuckets must match kSubBucketBits.");
+
+      // Returns the position in SummaryValueBase::octaves_ and the
+      // sub-bucket of v, or false if v is counted as 0.
+      bool summary_bucket(double v, std::size_t* octave, std::size_t* sub) {
+        double a = std::fabs(v);
+        if (a < std::ldexp(1.0, kMinExponent)) {
+          return false;
+        }
+        int exponent = kMinExponent + kOctaves - 1;
+        std::size_t sub_bucket = SummaryValueBase::kSubBuckets - 1;
+        if (a < std::ldexp(1.0, kMinExponent + kOctaves)) {
+          uint64_t bits;
+          std::memcpy(&bits, &a, sizeof(bits));
+          exponent = int((bits >> 52) & 0x7ff) - 1023;
+          sub_bucket = (bits >> (52 - kSubBucketBits)) &
+                       (SummaryValueBase::kSubBuckets - 1);
         }
+        *octave = (v < 0 ? kOctaves : 0) + (exponent - kMinExponent);
+        *sub = sub_bucket;
+        return true;
+      }
+
+      // Returns the value used to represent a sub-bucket: the middle
+      // of its range.
+      double summary_bucket_value(std::size_t octave, std::size_t sub) {
+        bool negative = octave >= std::size_t(kOctaves);
+        int exponent = int(octave % kOctaves) + kMinExponent;
+        double v = std::ldexp(1.0 + (sub + 0.5) / SummaryValueBase::kSubBuckets,
+                              exponent);
+        return negative ? -v : v;
+      }
+    } /* namespace */
+
+    SummaryValueBase::SummaryValueBase(std::vector<double> const& quantiles,
+                                       duration max_age, int age_buckets)
+        : quantiles_(quantiles),
+          window_duration_(age_buckets > 0 ? max_age / age_buckets
+                                           : duration::zero()),
+          age_buckets_(age_buckets > 0 ? age_buckets : 0),
+          octaves_(new std::atomic<counter*>[2 * kOctaves]),
+          zero_counts_(new counter[age_buckets_]),
+          window_slots_(new std::atomic<int64_t>[age_buckets_]),
+          count_(0),
+          sum_(0) {
+      if (age_buckets <= 0 || window_duration_ <= duration::zero()) {
+        throw std::logic_error("max_age and age_buckets must be positive");
+      }
+      for (double q : quantiles_) {
+        if (!(q >= 0 && q <= 1)) {
+          throw err::InvalidQuantileException();
+        }
+      }
+      for (int i = 0; i < 2 * kOctaves; ++i) {
+        octaves_[i].store(nullptr, std::memory_order_relaxed);
+      }
+      for (std::size_t w = 0; w < age_buckets_; ++w) {
+        zero_counts_[w].store(0, std::memory_order_relaxed);
+        window_slots_[w].store(std::numeric_limits<int64_t>::min(),
+                               std::memory_order_relaxed);
       }
     }
 
-    /* static */ void HistogramValue::set_metricfamily_type(MetricFamily* mf) {
-      mf->set_type(::prometheus::client::MetricType::HISTOGRAM);
+    SummaryValueBase::SummaryValueBase(SummaryValueBase const& rhs)
+        : SummaryValueBase(rhs.quantiles_, rhs.window_duration_ * rhs.age_buckets_,
+                       int(rhs.age_buckets_)) {}
+
+    SummaryValueBase::~SummaryValueBase() {
+      for (int i = 0; i < 2 * kOctaves; ++i) {
+        delete[] octaves_[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    int64_t SummaryValueBase::slot_at(duration now) const {
+      return now / window_duration_;
+    }
+
+    std::size_t SummaryValueBase::window_at(duration now) {
+      int64_t slot = slot_at(now);
+      std::size_t w = std::size_t(slot % int64_t(age_buckets_));
+      if (window_slots_[w].load(std::memory_order_acquire) == slot) {
+        return w;
+      }
+      std::lock_guard<std::mutex> l(rotation_mutex_);
+      if (window_slots_[w].load(std::memory_order_relaxed) < slot) {
+        zero_counts_[w].store(0, std::memory_order_relaxed);
+        for (int i = 0; i < 2 * kOctaves; ++i) {
+          counter* c = octaves_[i].load(std::memory_order_acquire);
+          if (c) {
+            for (int j = 0; j < kSubBuckets; ++j) {
+              c[w * kSubBuckets + j].store(0, std::memory_order_relaxed);
+            }
+          }
+        }
+        window_slots_[w].store(slot, std::memory_order_release);
+      }
+      return w;
+    }
+
+    SummaryValueBase::counter& SummaryValueBase::counter_for(double v, std::size_t w) {
+      std::size_t octave, sub;
+      if (!summary_bucket(v, &octave, &sub)) {
+        return zero_counts_[w];
+      }
+      counter* c = octaves_[octave].load(std::memory_order_acquire);
+      if (!c) {
+        std::size_t size = age_buckets_ * kSubBuckets;
+        counter* fresh = new counter[size];
+        for (std::size_t i = 0; i < size; ++i) {
+          fresh[i].store(0, std::memory_order_relaxed);
+        }
+        if (octaves_[octave].compare_exchange_strong(
+                c, fresh, std::memory_order_acq_rel)) {
+          c = fresh;
+        } else {
+          delete[] fresh;
+        }
+      }
+      return c[w * kSubBuckets + sub];
     }
 
+    void SummaryValueBase::observe_at(double v, duration now) {
+      count_.fetch_add(1, std::memory_order_relaxed);
+      double current = sum_.load(std::memory_order_relaxed);
+      while (!(sum_.compare_exchange_weak(current, current + v,
+                                          std::memory_order_relaxed)))
+        ;
+      if (std::isnan(v)) {
+        return;
+      }
+      counter_for(v, window_at(now))
+          .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void SummaryValueBase::quantiles_at(std::vector<double> const& qs,
+                                        duration now, double* out) const {
+      // Only sub-windows cleared during the last age_buckets_ slots
+      // hold values from the last max_age.
+      int64_t slot = slot_at(now);
+      std::vector<std::size_t> live;
+      for (std::size_t w = 0; w < age_buckets_; ++w) {
+        if (window_slots_[w].load(std::memory_order_acquire) >
+            slot - int64_t(age_buckets_)) {
+          live.push_back(w);
+        }
+      }
+
+      // Gather non-empty buckets in increasing order of value:
+      // negative values by decreasing magnitude, 0, then positive
+      // values by increasing magnitude.
+      std::vector<std::pair<double, uint64_t>> buckets;
+      uint64_t total = 0;
+      auto add_octave = [&](std::size_t octave, bool reverse) {
+        counter const* c = octaves_[octave].load(std::memory_order_acquire);
+        if (!c) {
+          return;
+        }
+        for (int k = 0; k < kSubBuckets; ++k) {
+          std::size_t sub = reverse ? kSubBuckets - 1 - k : k;
+          uint64_t n = 0;
+          for (std::size_t w : live) {
+            n += c[w * kSubBuckets + sub].load(std::memory_order_relaxed);
+          }
+          if (n > 0) {
+            buckets.push_back(
+                std::make_pair(summary_bucket_value(octave, sub), n));
+            total += n;
+          }
+        }
+      };
+      for (int o = 2 * kOctaves - 1; o >= kOctaves; --o) {
+        add_octave(o, true);
+      }
+      uint64_t zeros = 0;
+      for (std::size_t w : live) {
+        zeros += zero_counts_[w].load(std::memory_order_relaxed);
+      }
+      if (zeros > 0) {
+        buckets.push_back(std::make_pair(0.0, zeros));
+        total += zeros;
+      }
+      for (int o = 0; o < kOctaves; ++o) {
+        add_octave(o, false);
+      }
+
+      for (std::size_t i = 0; i < qs.size(); ++i) {
+        if (total == 0) {
+          out[i] = std::numeric_limits<double>::quiet_NaN();
+          continue;
+        }
+        uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(qs[i] * total)));
+        uint64_t cumulative = 0;
+        out[i] = buckets.back().first;
+        for (auto const& b : buckets) {
+          cumulative += b.second;
+          if (cumulative >= rank) {
+            out[i] = b.first;
+            break;
+          }
+        }
+      }
+    }
+
+    double SummaryValueBase::quantile_at(double q, duration now) const {
+      double out;
+      quantiles_at(std::vector<double>(1, q), now, &out);
+      return out;
+    }
+
+    double SummaryValueBase::value() const {
+      return count_.load(std::memory_order_relaxed);
+    }
+
+    double SummaryValueBase::sum() const {
+      return sum_.load(std::memory_order_relaxed);
+    }
+
+    void SummaryValueBase::collect_value_at(MetricSink* sink,
+                                            duration now) const {
+      std::vector<double> values(quantiles_.size());
+      quantiles_at(quantiles_, now, values.data());
+      for (std::size_t i = 0; i < quantiles_.size(); ++i) {
+        sink->quantile(quantiles_[i], values[i]);
+      }
+      sink->summary(count_.load(std::memory_order_relaxed),
+                    sum_.load(std::memory_order_relaxed));
+    }
+
+
   }
 }
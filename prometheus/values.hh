@@ -1,11 +1,18 @@
 #ifndef PROMETHEUS_VALUES_HH__
 #define PROMETHEUS_VALUES_HH__
 
-#include "proto/stubs.hh"
+#include "exceptions.hh"
+#include "sink.hh"
 
 #include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 namespace prometheus {
@@ -21,6 +28,13 @@ namespace prometheus {
   // label name sets or other arguments when building LabeledMetrics.
   std::vector<double> histogram_levels(std::vector<double>&&);
 
+  // The quantiles reported by default by summaries.
+  extern const std::vector<double> default_summary_quantiles;
+
+  // This wrapper ensures that summary quantiles are not confused with
+  // label name sets or other arguments when building LabeledMetrics.
+  std::vector<double> summary_quantiles(std::vector<double>&&);
+
   // Constructs a list of `count` histogram buckets increasing
   // exponentially, from `base**starting_exponent`. 0 and +Inf are
   // added at the beginning and end, respectively. Throws a
@@ -37,9 +51,6 @@ namespace prometheus {
 
   namespace impl {
 
-    using ::prometheus::client::Metric;
-    using ::prometheus::client::MetricFamily;
-
     class BaseScalarValue {
       // A base class used by the various scalar values (counter and gauges).
      public:
@@ -62,8 +73,8 @@ namespace prometheus {
       // "Inc/Dec" gauges from "Set" gauges to allow us to squeeze
       // some performance by using different types of memory barriers.
      public:
-      void collect_value(Metric* m) const;
-      static void set_metricfamily_type(MetricFamily* mf);
+      void collect_value(MetricSink* sink) const;
+      static MetricType metric_type() { return MetricType::kGauge; }
     };
 
     class SetGaugeValue : public BaseGaugeValue {
@@ -86,23 +97,224 @@ namespace prometheus {
       // NegativeCounterIncrementException.
      public:
       void inc(double value = 1.0);
-      void collect_value(Metric* m) const;
-      static void set_metricfamily_type(MetricFamily* mf);
+      void collect_value(MetricSink* sink) const;
+      static MetricType metric_type() { return MetricType::kCounter; }
+    };
+
+    template <typename T>
+    class IntegerCounterValue {
+      // A counter stored as an integer of type T (e.g. uint64_t),
+      // for counters that count events or bytes. inc() is a single
+      // atomic fetch_add, without the compare-and-swap retry loop
+      // needed to add to a double. The value is converted to a
+      // double only when it is read or collected.
+      static_assert(std::is_integral<T>::value,
+                    "IntegerCounterValue requires an integral type.");
+
+     public:
+      IntegerCounterValue() : value_(0) {}
+      IntegerCounterValue(IntegerCounterValue const& rhs)
+          : value_(rhs.value_.load(std::memory_order_relaxed)) {}
+
+      void inc() { value_.fetch_add(1, std::memory_order_relaxed); }
+
+      // Increments the counter by a value of any integral type, which
+      // is checked before it is converted to T: a negative value
+      // throws a NegativeCounterIncrementException, even if T is
+      // unsigned. Non-integral values (e.g. 2.9) don't compile, rather
+      // than being truncated.
+      template <typename U, typename = typename std::enable_if<
+                                std::is_integral<U>::value>::type>
+      void inc(U value) {
+        if (is_negative(value)) {
+          throw err::NegativeCounterIncrementException();
+        }
+        value_.fetch_add(static_cast<T>(value), std::memory_order_relaxed);
+      }
+
+      double value() const {
+        return static_cast<double>(value_.load(std::memory_order_relaxed));
+      }
+
+      void collect_value(MetricSink* sink) const { sink->value(value()); }
+      static MetricType metric_type() { return MetricType::kCounter; }
+
+     private:
+      template <typename U>
+      static typename std::enable_if<std::is_signed<U>::value, bool>::type
+      is_negative(U v) {
+        return v < 0;
+      }
+      template <typename U>
+      static typename std::enable_if<!std::is_signed<U>::value, bool>::type
+      is_negative(U) {
+        return false;
+      }
+
+      std::atomic<T> value_;
+    };
+
+    template <typename T>
+    class IntegerIncDecGaugeValue {
+      // A gauge stored as an integer of type T (e.g. int64_t), that
+      // can only be incremented or decremented. Like
+      // IntegerCounterValue, updates are a single atomic fetch_add.
+      // T must be signed, so that the gauge can go below 0 instead of
+      // wrapping around.
+      static_assert(std::is_integral<T>::value && std::is_signed<T>::value,
+                    "IntegerIncDecGaugeValue requires a signed integral "
+                    "type.");
+
+     public:
+      IntegerIncDecGaugeValue() : value_(0) {}
+      IntegerIncDecGaugeValue(IntegerIncDecGaugeValue const& rhs)
+          : value_(rhs.value_.load(std::memory_order_relaxed)) {}
+
+      void inc() { value_.fetch_add(1, std::memory_order_relaxed); }
+      void dec() { value_.fetch_sub(1, std::memory_order_relaxed); }
+
+      // Increments or decrements the gauge by a value of any integral
+      // type. Non-integral values (e.g. 0.5) don't compile, rather
+      // than being truncated.
+      template <typename U, typename = typename std::enable_if<
+                                std::is_integral<U>::value>::type>
+      void inc(U value) {
+        value_.fetch_add(static_cast<T>(value), std::memory_order_relaxed);
+      }
+      template <typename U, typename = typename std::enable_if<
+                                std::is_integral<U>::value>::type>
+      void dec(U value) {
+        value_.fetch_sub(static_cast<T>(value), std::memory_order_relaxed);
+      }
+
+      double value() const {
+        return static_cast<double>(value_.load(std::memory_order_relaxed));
+      }
+
+      void collect_value(MetricSink* sink) const { sink->value(value()); }
+      static MetricType metric_type() { return MetricType::kGauge; }
+
+     private:
+      std::atomic<T> value_;
+    };
+
+    class ShardedCounterValue {
+      // A counter that spreads its increments over several
+      // cache-line sized cells, so that threads incrementing it
+      // concurrently don't all write to the same cache line. Each
+      // thread always uses the same cell, and cells are summed when
+      // the value is read or collected. This makes inc() scale with
+      // the number of cores, at the cost of more memory per counter
+      // (one cache line per cell) and a slower value().
+     public:
+      ShardedCounterValue();
+      ~ShardedCounterValue();
+      ShardedCounterValue(ShardedCounterValue const& rhs);
+
+      // Increments the counter. Throws a
+      // NegativeCounterIncrementException if value is negative.
+      void inc(double value = 1.0);
+
+      // Returns the sum of all cells.
+      double value() const;
+
+      void collect_value(MetricSink* sink) const;
+      static MetricType metric_type() { return MetricType::kCounter; }
+
+      // The number of cells used by each sharded counter. This is
+      // the number of hardware threads rounded up to a power of two,
+      // capped to kMaxCells.
+      static unsigned cell_count();
+
+     private:
+      static const unsigned kCacheLineSize = 64;
+      static const unsigned kMaxCells = 64;
+
+      struct Cell {
+        std::atomic<double> value;
+        char padding[kCacheLineSize - sizeof(std::atomic<double>)];
+      };
+
+      Cell& cell_for_current_thread();
+
+      // cells_ points inside buffer_, aligned on a cache line.
+      std::unique_ptr<char[]> buffer_;
+      Cell* cells_;
+    };
+
+    class HistogramLayout {
+      // The immutable list of bucket levels of a histogram, always
+      // ending with +Inf. A layout is shared (through a shared_ptr)
+      // by a HistogramValue and all of its copies, so all children of
+      // a labeled histogram use the same layout instead of each
+      // storing their own copy of the levels.
+      //
+      // At construction, the layout recognizes levels that were
+      // generated by histogram_levels_linear (evenly spaced levels)
+      // or histogram_levels_powers_of(2, ...) (consecutive powers of
+      // two, optionally preceded by one smaller level). For those,
+      // bucket_index() computes the bucket directly in constant time
+      // instead of searching the levels.
+     public:
+      enum Kind {
+        kSearch,       // Any levels: vectorized search.
+        kLinear,       // Evenly spaced levels: division.
+        kPowersOfTwo,  // Powers of two: exponent extraction.
+      };
+
+      // Throws an UnsortedLevelsException if levels are not strictly
+      // increasing.
+      explicit HistogramLayout(std::vector<double> const& levels);
+
+      // Number of buckets, including the +Inf bucket.
+      std::size_t size() const { return levels_.size(); }
+
+      std::vector<double> const& levels() const { return levels_; }
+
+      // How bucket_index() locates buckets in this layout.
+      Kind kind() const { return kind_; }
+
+      // Returns the index of the first bucket whose level is superior
+      // or equal to v, or the +Inf bucket if there is none.
+      std::size_t bucket_index(double v) const;
+
+     private:
+      std::size_t linear_index(double v) const;
+      std::size_t powers_of_two_index(double v) const;
+
+      const std::vector<double> levels_;
+      std::size_t (*const search_)(double const*, std::size_t, double);
+      Kind kind_;
+      // For kLinear: levels_[i] ~= first_level_ + i * increment_.
+      double first_level_;
+      double increment_;
+      // For kPowersOfTwo: levels_[first_power_index_ + i] is
+      // 2**(first_exponent_ + i).
+      std::size_t first_power_index_;
+      int first_exponent_;
     };
 
     class HistogramValue {
-      // This is the internal representation of a histogram.
+      // This is the internal representation of a histogram. Buckets
+      // are stored non-cumulatively, as one atomic count per bucket,
+      // so that observe() only increments a single bucket and never
+      // takes a lock. Cumulative counts are computed when reading the
+      // histogram.
 
      public:
       // A histogram is always constructed with a fixed list of
       // strictly increasing levels.
       HistogramValue(
           std::vector<double> const& levels = default_histogram_levels);
+      // Builds a histogram that uses an existing layout.
+      explicit HistogramValue(
+          std::shared_ptr<const HistogramLayout> const& layout);
       ~HistogramValue();
       HistogramValue(HistogramValue const& rhs);
 
-      // Observe the given value. This increments all buckets whose
-      // threshold is superior or equal to the value.
+      // Observe the given value. This increments the first bucket
+      // whose threshold is superior or equal to the value. NaN is
+      // counted in the +Inf bucket.
       void observe(double value);
 
       // Returns true if d is +Inf.
@@ -116,23 +328,350 @@ namespace prometheus {
       // total count of observed values.
       double value(double threshold = kInf) const;
 
-      // Collects the value to a Metric.
-      void collect_value(Metric* m) const;
+      // Collects the value to a sink. Buckets are read one at a
+      // time without stopping concurrent observations, so the sum
+      // may not exactly match the counts if observe() runs
+      // concurrently. The counts themselves are always consistent
+      // with the +Inf bucket.
+      void collect_value(MetricSink* sink) const;
+
+      // The type of a MetricFamily that contains this kind of Value.
+      static MetricType metric_type() { return MetricType::kHistogram; }
 
-      // Sets the type of a MetricFamily that contains this kind of Value.
-      static void set_metricfamily_type(MetricFamily* mf);
+      // The layout of this histogram, shared with its copies.
+      std::shared_ptr<const HistogramLayout> const& layout() const {
+        return layout_;
+      }
 
      private:
+      void reset_counts();
+
+      const std::shared_ptr<const HistogramLayout> layout_;
+      std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+      std::atomic<double> samples_sum_;
+    };
+
+    class ThreadCells : public std::enable_shared_from_this<ThreadCells> {
+      // The per-thread cells of a batched value (BatchedCounterValue,
+      // BatchedHistogramValue). Each thread that updates the value
+      // gets its own cell, found through a thread-local table indexed
+      // by a small id that is unique among live ThreadCells. A cell
+      // is only written by its thread, with relaxed loads and stores
+      // rather than atomic read-modify-write operations, and is read
+      // by the collecting thread. When a thread exits, its cells are
+      // merged into the retired totals of their values by
+      // retire_cell(). Updates made after that by the destructors of
+      // other thread_local objects of the thread find no table: they
+      // are added straight to the retired totals, under the mutex.
+      //
+      // ThreadCells must be owned by a shared_ptr, so that exiting
+      // threads can tell whether the value still exists.
+     public:
+      ThreadCells();
+      virtual ~ThreadCells();
+
+     protected:
+      // Returns the cell of the current thread, or nullptr if this
+      // thread hasn't registered one yet.
+      void* find_cell() const;
+      // Registers the cell of the current thread and returns it.
+      // Returns nullptr instead if the thread is exiting and its table
+      // of cells was already destroyed; the caller must then update
+      // the retired totals itself.
+      void* add_cell(std::shared_ptr<void> const& cell);
+      // Merges a cell into the retired totals. Called with mutex_
+      // held, when the thread owning the cell exits.
+      virtual void retire_cell(void const* cell) = 0;
+
+      // Protects cells_ and the retired totals of subclasses.
       mutable std::mutex mutex_;
-      // TODO(korfuri): The current usage duplicates the list of
-      // levels for each HistogramValue, causing unnecessary memory
-      // usage in labeled histograms. We should store the levels in
-      // the Metric or in an intermediary class, to avoid duplication.
-      const std::vector<double> levels_;
-      std::vector<uint64_t> values_;
-      double samples_sum_;
+      // The cells of all live threads that updated this value.
+      std::vector<std::shared_ptr<void>> cells_;
+
+     private:
+      struct Slot;
+      struct ThreadSlots;
+      static ThreadSlots& thread_slots();
+      void retire(std::shared_ptr<void> const& cell);
+
+      const std::size_t id_;
+      // Unlike id_, serial_ is never reused, so a thread can tell
+      // whether its slot belongs to this ThreadCells or to a
+      // previous owner of the same id.
+      const uint64_t serial_;
+    };
+
+    class BatchedCounterValue {
+      // A counter for very hot code paths. Each thread increments a
+      // cell of its own with a plain (non read-modify-write) store, so
+      // inc() costs about as much as incrementing a local variable,
+      // and cells are summed when the counter is read or collected.
+      //
+      // Staleness: a read or collection includes every increment that
+      // happened before it started (e.g. increments of threads it was
+      // synchronized with, or that exited before). Increments that
+      // run concurrently with it may be reported by the next
+      // collection only. No increment is lost when a thread exits.
+      //
+      // Each thread that ever incremented the counter costs one cell
+      // until it exits, so this is meant for counters updated by a
+      // bounded set of long-lived threads.
+     public:
+      BatchedCounterValue();
+      ~BatchedCounterValue();
+      BatchedCounterValue(BatchedCounterValue const& rhs);
+
+      // Increments the counter. Throws a
+      // NegativeCounterIncrementException if value is negative.
+      void inc(double value = 1.0);
+
+      // Returns the sum of the cells of all threads.
+      double value() const;
+
+      void collect_value(MetricSink* sink) const;
+      static MetricType metric_type() { return MetricType::kCounter; }
+
+     private:
+      class Cells;
+      std::shared_ptr<Cells> cells_;
+    };
+
+    class BatchedHistogramValue {
+      // A histogram whose observations are batched in per-thread
+      // cells, like BatchedCounterValue. Each cell holds a count per
+      // bucket and a sum; they are merged when the histogram is read
+      // or collected, with the same staleness as BatchedCounterValue.
+     public:
+      BatchedHistogramValue(
+          std::vector<double> const& levels = default_histogram_levels);
+      ~BatchedHistogramValue();
+      BatchedHistogramValue(BatchedHistogramValue const& rhs);
+
+      // Observe the given value. This increments the first bucket
+      // whose threshold is superior or equal to the value. NaN is
+      // counted in the +Inf bucket.
+      void observe(double value);
+
+      // Returns the count of observed events at the given threshold
+      // (rounded up to the next bucket if necessary). Defaults to
+      // +Inf, which means returning the total count of observed
+      // values.
+      double value(double threshold = kInf) const;
+
+      void collect_value(MetricSink* sink) const;
+      static MetricType metric_type() { return MetricType::kHistogram; }
+
+      // The layout of this histogram, shared with its copies.
+      std::shared_ptr<const HistogramLayout> const& layout() const;
+
+     private:
+      class Cells;
+      std::shared_ptr<Cells> cells_;
     };
 
+    class SparseHistogramValue {
+      // A histogram that doesn't need bucket levels. Buckets grow
+      // exponentially: with schema s, each bucket is 2**(2**-s) times
+      // wider than the previous one, so the relative error of the
+      // histogram is constant. Schemas range from -4 (each bucket is
+      // 65536 times wider than the previous one) to 8 (buckets grow
+      // by ~0.27%). Bucket i of a schema holds positive values v such
+      // that base**(i-1) < v <= base**i, and negative values such that
+      // base**(i-1) <= -v < base**i, so that each bucket is collected
+      // with an inclusive upper bound. Values within zero_threshold of
+      // 0 are counted in a separate zero bucket.
+      //
+      // Buckets are only allocated when a value falls into them, so
+      // memory follows the range of values actually observed. When
+      // more than max_buckets buckets are in use, the schema is
+      // decremented, which merges buckets two by two, until the
+      // histogram fits.
+      //
+      // The bucket of a value is computed from its exponent bits, with
+      // a binary search over at most 2**s mantissa bounds for
+      // positive schemas. Updates take a lock that is specific to this
+      // value.
+      //
+      // The histogram is collected as a classic histogram, with one
+      // bucket per populated sparse bucket (and the zero bucket), so
+      // existing consumers of the text format can read it. As the set
+      // of populated buckets grows, so does the set of "le" labels.
+     public:
+      static const int kMinSchema = -4;
+      static const int kMaxSchema = 8;
+
+      // Throws a logic_error if schema is outside of [kMinSchema,
+      // kMaxSchema], max_buckets is 0 or zero_threshold is negative.
+      SparseHistogramValue(int schema = 3, std::size_t max_buckets = 160,
+                           double zero_threshold = 2.938735877055719e-39);
+      ~SparseHistogramValue();
+      SparseHistogramValue(SparseHistogramValue const& rhs);
+
+      // Observes the given value. NaN is counted in the count and the
+      // sum, but not in any finite bucket.
+      void observe(double value);
+
+      // Returns the count of observed values. This is useful for
+      // testing.
+      double value() const;
+
+      // Returns the current schema, which decreases when the
+      // histogram reduces its resolution.
+      int schema() const;
+
+      // Returns the number of populated buckets, excluding the zero
+      // bucket.
+      std::size_t bucket_count() const;
+
+      // Returns the index of the bucket holding |v| in schema s. v
+      // must be a positive number.
+      static int bucket_index(double v, int s);
+
+      // Returns the upper bound of bucket i in schema s.
+      static double bucket_upper_bound(int i, int s);
+
+      // Collects the value to a sink.
+      void collect_value(MetricSink* sink) const;
+
+      // The type of a MetricFamily that contains this kind of Value.
+      static MetricType metric_type() { return MetricType::kHistogram; }
+
+     private:
+      // Decrements the schema until at most max_buckets_ are in use.
+      // mutex_ must be held.
+      void reduce_resolution();
+
+      const std::size_t max_buckets_;
+      const double zero_threshold_;
+      mutable std::mutex mutex_;
+      // Only modified with mutex_ held, but read without it to compute
+      // bucket indexes outside of the lock.
+      std::atomic<int> schema_;
+      std::unordered_map<int, uint64_t> positive_;
+      std::unordered_map<int, uint64_t> negative_;
+      uint64_t zero_count_;
+      uint64_t count_;
+      double sum_;
+    };
+
+    class SummaryValueBase {
+      // This is the internal representation of a summary. It reports
+      // a fixed set of quantiles over the values observed during the
+      // last `max_age`, as well as the total count and sum of all
+      // observed values.
+      //
+      // Values are counted in log-linear buckets: each power of two
+      // is split in kSubBuckets equal parts, so a quantile is
+      // estimated with a relative error of at most 1/(2*kSubBuckets).
+      // Buckets are allocated one power of two at a time, the first
+      // time a value falls in it, so memory is bounded by the range of
+      // observed values. Values whose magnitude is below 2**-64 are
+      // counted as 0, values whose magnitude is 2**64 or more are
+      // counted in the largest bucket.
+      //
+      // The sliding window is made of `age_buckets` sub-windows of
+      // max_age/age_buckets each. observe() increments one bucket of
+      // the current sub-window with a relaxed atomic add, and never
+      // takes a lock except to clear a sub-window when time moves
+      // into it, once every max_age/age_buckets.
+      //
+      // The current time is passed in by BasicSummaryValue, as a
+      // duration since the epoch of its clock.
+     public:
+      static const int kSubBuckets = 32;
+      typedef std::chrono::nanoseconds duration;
+
+      // Throws an InvalidQuantileException if a quantile is not
+      // within [0, 1], and a logic_error if max_age or age_buckets is
+      // not positive.
+      SummaryValueBase(std::vector<double> const& quantiles,
+                       duration max_age, int age_buckets);
+      ~SummaryValueBase();
+      SummaryValueBase(SummaryValueBase const& rhs);
+
+      // Returns the count of observed values. This is useful for
+      // testing.
+      double value() const;
+
+      // Returns the sum of observed values.
+      double sum() const;
+
+      // The type of a MetricFamily that contains this kind of Value.
+      static MetricType metric_type() { return MetricType::kSummary; }
+
+     protected:
+      // Observes the given value at time now. NaN values are counted
+      // in the sum and count, but not in quantiles.
+      void observe_at(double value, duration now);
+      // Returns the estimated q-quantile at time now.
+      double quantile_at(double q, duration now) const;
+      // Collects the value at time now to a sink.
+      void collect_value_at(MetricSink* sink, duration now) const;
+
+     private:
+      typedef std::atomic<uint64_t> counter;
+
+      // Estimates quantiles qs (sorted) at time now into out.
+      void quantiles_at(std::vector<double> const& qs, duration now,
+                        double* out) const;
+      // Returns the sub-window for time now, clearing it first if it
+      // was last used for an older time slot.
+      std::size_t window_at(duration now);
+      int64_t slot_at(duration now) const;
+      // Returns the counter for v in window w, allocating its bucket
+      // if needed.
+      counter& counter_for(double v, std::size_t w);
+
+      const std::vector<double> quantiles_;
+      const duration window_duration_;
+      const std::size_t age_buckets_;
+
+      // One entry per power of two of each sign. Each is null until a
+      // value falls in that power of two, then points to
+      // age_buckets_ * kSubBuckets counters.
+      std::unique_ptr<std::atomic<counter*>[]> octaves_;
+      // Count of values counted as 0, per sub-window.
+      std::unique_ptr<counter[]> zero_counts_;
+      // The time slot each sub-window was last cleared for.
+      std::unique_ptr<std::atomic<int64_t>[]> window_slots_;
+      std::mutex rotation_mutex_;
+
+      std::atomic<uint64_t> count_;
+      std::atomic<double> sum_;
+    };
+
+    template <typename clock_t = std::chrono::steady_clock>
+    class BasicSummaryValue : public SummaryValueBase {
+      // A summary whose sliding window follows clock_t. Tests use
+      // testing::fake_clock to move the window without sleeping.
+     public:
+      BasicSummaryValue(
+          std::vector<double> const& quantiles = default_summary_quantiles,
+          duration max_age = std::chrono::minutes(10), int age_buckets = 5)
+          : SummaryValueBase(quantiles, max_age, age_buckets) {}
+
+      // Observes the given value. NaN values are counted in the sum
+      // and count, but not in quantiles.
+      void observe(double value) { observe_at(value, now()); }
+
+      // Returns the estimated q-quantile of the values observed
+      // during the last max_age, or NaN if there are none.
+      double quantile(double q) const { return quantile_at(q, now()); }
+
+      // Collects the value to a sink.
+      void collect_value(MetricSink* sink) const {
+        collect_value_at(sink, now());
+      }
+
+     private:
+      static duration now() {
+        return std::chrono::duration_cast<duration>(
+            clock_t::now().time_since_epoch());
+      }
+    };
+
+    typedef BasicSummaryValue<> SummaryValue;
+
   } /* namespace impl */
 } /* namespace prometheus */
 